@@ -1,98 +1,671 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <math.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include <pthread.h>
 
-#include <SDL2/SDL.h>
-#include <SDL_mixer.h>
 #include <samplerate.h>
 
 #include "s3m.h"
 
-#define BASE_SAMPLE_RATE 48000
-#define FBASE_SAMPLE_RATE ((float) BASE_SAMPLE_RATE)
+#define NUM_CHANNELS 32
 
-#define CHUNK_SIZE 1024
+// Enough for every row that fits in two of the largest output buffers
+#define EVENT_QUEUE_SIZE 8192
 
-#define NUM_CHANNELS 32
+// Large enough that a full block of many voices is worth splitting across the mix pool
+#define MIX_BLOCK_SIZE 4096
+#define MIX_MAX_CHANNELS 2
 
-static Mix_Chunk channels[NUM_CHANNELS];
+// In stereo, voices are mixed in mono into one bus per pan, and each bus is panned once.
+// Gains are out of PAN_ONE, with buses shifted down by PAN_SHIFT first to stay in range.
+#define MIX_NUM_BUSES (S3M_PAN_MONO + 1)
+#define PAN_SHIFT 6
+#define PAN_ONE (1 << PAN_SHIFT)
 
-static int16_t *resample_cache[100][256];
+#define MIX_MAX_TASKS S3M_MAX_MIX_THREADS
 
-int s3m_init_audio(void) {
-    if(SDL_InitSubSystem(SDL_INIT_AUDIO)) {
-        fprintf(stderr, "Unable to initialize SDL: %s\n", SDL_GetError());
-        return 1;
-    }
+// Blocks mixed serially and split, to measure what a pool round trip costs against mixing
+#define MIX_CALIBRATION_ROUNDS 64
+#define MIX_CALIBRATION_RUNS 3
+
+// Voice positions are 32.32 fixed point offsets into the resampled sample
+#define FP_SHIFT 32
+#define FP_ONE (((uint64_t) 1) << FP_SHIFT)
+#define FP_FRAC(fp_) ((uint32_t) (fp_))
+
+#define INSTRUMENT_FLAG_LOOP 1
+
+typedef struct voice {
+    const int16_t *data;
+    int volume;
+
+    // The bus it is mixed into in stereo
+    int pan;
+
+    uint64_t position;
+    uint64_t end;
+
+    uint64_t loop_length;
+} voice_t;
+
+static voice_t voices[NUM_CHANNELS];
+
+// Voice changes are queued by the player with the frame they take effect at and applied
+// by the renderer, so timing follows the output's sample clock instead of the wall clock.
+typedef enum event_type {
+    EVENT_VOICE,
+    EVENT_POSITION
+} event_type_t;
+
+typedef struct event {
+    uint64_t frame;
+    event_type_t type;
+
+    int channel;
+    voice_t voice;
+
+    uint32_t position;
+} event_t;
+
+static pthread_mutex_t schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rendered_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scheduled_cond = PTHREAD_COND_INITIALIZER;
+
+static event_t events[EVENT_QUEUE_SIZE];
+static unsigned events_head = 0;
+static unsigned events_count = 0;
+
+static uint64_t rendered_frames = 0;
+static uint64_t scheduled_frames = 0;
+static uint64_t schedule_ahead = 0;
+static int schedule_finished = 0;
+static uint64_t schedule_end = 0;
+
+// The latest position marker that became audible, with a serial number in the high half
+static atomic_uint_fast64_t now_playing;
+
+typedef struct mix_job {
+    int32_t *mix;
+    unsigned frames;
+
+    int num_tasks;
+    int num_voices;
+    int active[NUM_CHANNELS];
+} mix_job_t;
+
+static s3m_pool_t mix_pool;
+static int32_t *task_mix[MIX_MAX_TASKS];
+static int32_t *task_buses[MIX_MAX_TASKS];
+static int32_t pan_gains[MIX_NUM_BUSES][2];
+
+// Voice-frames of work a task needs before splitting it off pays for the pool round trip.
+// Measured at startup, since both costs vary a lot from one machine to the next.
+static unsigned mix_min_work_per_task = UINT_MAX;
+
+static int output_rate;
+static int output_channels;
+
+// Kept as plain loops over restrict pointers, so the compiler can vectorize them
 
-    if (Mix_OpenAudio(BASE_SAMPLE_RATE, AUDIO_S16SYS, 1, CHUNK_SIZE)) {
-        fprintf(stderr, "Unable to initialize the mixer: %s\n", Mix_GetError());
-        return 2;
+static void mix_mono(int32_t *restrict dst, const int16_t *restrict src, unsigned length,
+        int volume) {
+    for (unsigned k = 0; k < length; ++k) {
+        dst[k] += src[k] * volume;
     }
+}
 
-    Mix_AllocateChannels(NUM_CHANNELS);
+static void mix_mono_interpolated(int32_t *restrict dst, const int16_t *restrict src,
+        unsigned length, int volume, uint32_t frac) {
+    for (unsigned k = 0; k < length; ++k) {
+        int32_t delta = src[k + 1] - src[k];
+        int32_t sample = src[k] + (int32_t) (((int64_t) delta * frac) >> FP_SHIFT);
+        dst[k] += sample * volume;
+    }
+}
 
-    for (int i = 0; i < NUM_CHANNELS; ++i) {
-        channels[i].allocated = 0;
-        channels[i].volume = 128;
+// Indexed with size_t, since an unsigned 2 * k could wrap and defeat vectorization
+static void pan_bus(int32_t *restrict mix, const int32_t *restrict bus, unsigned frames,
+        int32_t left, int32_t right) {
+    for (size_t k = 0; k < frames; ++k) {
+        int32_t sample = bus[k] >> PAN_SHIFT;
+        mix[2 * k] += sample * left;
+        mix[2 * k + 1] += sample * right;
     }
+}
+
+static void render_voice(voice_t *voice, int32_t *mix, unsigned frames) {
+    unsigned i = 0;
+
+    while (i < frames && voice->data) {
+        if (voice->position >= voice->end) {
+            if (!voice->loop_length) {
+                voice->data = NULL;
+                break;
+            }
+
+            // Sustain by wrapping the read position back into the loop
+            do {
+                voice->position -= voice->loop_length;
+            } while (voice->position >= voice->end);
+        }
+
+        uint64_t remaining = (voice->end - voice->position + FP_ONE - 1) >> FP_SHIFT;
+        unsigned length = frames - i;
+        if (remaining < length) length = (unsigned) remaining;
+
+        const int16_t *src = voice->data + (voice->position >> FP_SHIFT);
+        uint32_t frac = FP_FRAC(voice->position);
+
+        // A fractional loop length leaves the position between two samples after a wrap
+        if (!frac) {
+            mix_mono(mix + i, src, length, voice->volume);
+        } else {
+            // Only the last frame before the loop end can interpolate past it; its next
+            // sample is the one the loop wraps to
+            uint64_t last = voice->position + (((uint64_t) length - 1) << FP_SHIFT);
+            uint64_t next = ((last >> FP_SHIFT) + 1) << FP_SHIFT;
+            unsigned straight = next < voice->end || !voice->loop_length ? length : length - 1;
 
-    for (int i = 0; i < 100; ++i) {
-        for (int k = 0; k < 256; ++k) {
-            resample_cache[i][k] = NULL;
+            mix_mono_interpolated(mix + i, src, straight, voice->volume, frac);
+
+            if (straight < length) {
+                do {
+                    next -= voice->loop_length;
+                } while (next >= voice->end);
+
+                int32_t delta = voice->data[next >> FP_SHIFT] - src[straight];
+                int32_t sample = src[straight] + (int32_t) (((int64_t) delta * frac) >> FP_SHIFT);
+                mix[i + straight] += sample * voice->volume;
+            }
         }
+
+        voice->position += ((uint64_t) length) << FP_SHIFT;
+        i += length;
     }
+}
 
-    return 0;
+// Where a task's voices start. In stereo, each task rounds its buses as it pans them, so
+// a bus is never split between two tasks; the mix would then depend on the thread count.
+static int task_start(const mix_job_t *job, int index) {
+    int start = job->num_voices * index / job->num_tasks;
+    if (output_channels > 1) {
+        while (start > 0 && start < job->num_voices
+                && voices[job->active[start]].pan == voices[job->active[start - 1]].pan) {
+            ++start;
+        }
+    }
+    return start;
 }
 
-void s3m_play_sample(int channel, s3m_t *s3m, uint8_t instr, uint8_t bnote, uint8_t volume) {
-    if ((bnote >> 4) == 0xF) {
-        Mix_HaltChannel(channel);
+static void mix_task(void *arg, int index) {
+    mix_job_t *job = arg;
+
+    // Task 0 renders into the output block directly, the others into private blocks
+    int32_t *mix = job->mix;
+    if (index) {
+        mix = task_mix[index];
+        memset(mix, 0, job->frames * output_channels * sizeof(int32_t));
+    }
+
+    int first = task_start(job, index);
+    int last = task_start(job, index + 1);
+
+    if (output_channels == 1) {
+        for (int i = first; i < last; ++i) {
+            render_voice(voices + job->active[i], mix, job->frames);
+        }
         return;
     }
 
-    s3m_vinstrument_t *vinstr = s3m->instruments[instr];
+    // Each voice costs the same as in mono; panning costs per bus in use, not per voice
+    int32_t *buses = task_buses[index];
+    uint32_t used = 0;
 
-    double note = s3m_get_note_freq(vinstr, bnote);
-    double ratio = FBASE_SAMPLE_RATE / note;
-    unsigned output_length = (unsigned) ceil(vinstr->sample_length * ratio);
-    unsigned consv_output_length = (unsigned) floor(vinstr->sample_length * ratio);
+    for (int i = first; i < last; ++i) {
+        voice_t *voice = voices + job->active[i];
+        int32_t *bus = buses + voice->pan * MIX_BLOCK_SIZE;
+
+        if (!(used & (1u << voice->pan))) {
+            memset(bus, 0, job->frames * sizeof(int32_t));
+            used |= 1u << voice->pan;
+        }
+
+        render_voice(voice, bus, job->frames);
+    }
+
+    for (int b = 0; b < MIX_NUM_BUSES; ++b) {
+        if (used & (1u << b)) {
+            pan_bus(mix, buses + b * MIX_BLOCK_SIZE, job->frames, pan_gains[b][0], pan_gains[b][1]);
+        }
+    }
+}
+
+static void reduce_mix(int32_t *restrict mix, const int32_t *restrict src, unsigned length) {
+    for (unsigned i = 0; i < length; ++i) {
+        mix[i] += src[i];
+    }
+}
+
+static void mix_block(int16_t *out, unsigned frames, int max_tasks) {
+    // Stereo blocks are interleaved left and right
+    int32_t mix[MIX_BLOCK_SIZE * MIX_MAX_CHANNELS];
+    unsigned length = frames * output_channels;
+    memset(mix, 0, length * sizeof(int32_t));
+
+    mix_job_t job = {.mix = mix, .frames = frames};
+
+    // In stereo, voices are listed bus by bus so that tasks can split them between buses
+    int num_buses = output_channels > 1 ? MIX_NUM_BUSES : 1;
+    for (int b = 0; b < num_buses; ++b) {
+        for (int i = 0; i < NUM_CHANNELS; ++i) {
+            if (voices[i].data && (num_buses == 1 || voices[i].pan == b)) {
+                job.active[job.num_voices++] = i;
+            }
+        }
+    }
+
+    job.num_tasks = job.num_voices * frames / mix_min_work_per_task;
+    if (job.num_tasks > max_tasks) job.num_tasks = max_tasks;
+
+    if (job.num_tasks > 1) {
+        s3m_pool_run(&mix_pool, mix_task, &job, job.num_tasks);
+
+        for (int i = 1; i < job.num_tasks; ++i) {
+            reduce_mix(mix, task_mix[i], length);
+        }
+    } else {
+        job.num_tasks = 1;
+        mix_task(&job, 0);
+    }
+
+    for (unsigned i = 0; i < length; ++i) {
+        int32_t sample = mix[i] >> 7;
+        if (sample > INT16_MAX) sample = INT16_MAX;
+        if (sample < INT16_MIN) sample = INT16_MIN;
+
+        out[i] = (int16_t) sample;
+    }
+}
+
+unsigned s3m_audio_render(int16_t *out, unsigned frames, int wait) {
+    pthread_mutex_lock(&schedule_lock);
+    if (wait) {
+        // A full queue is rendered regardless, so the player can never stall the renderer
+        while (scheduled_frames < rendered_frames + frames && !schedule_finished
+                && events_count < EVENT_QUEUE_SIZE) {
+            pthread_cond_wait(&scheduled_cond, &schedule_lock);
+        }
+
+        // Renderers that wait also stop exactly where the schedule ends
+        if (schedule_finished) {
+            uint64_t left = schedule_end > rendered_frames ? schedule_end - rendered_frames : 0;
+            if (left < frames) frames = (unsigned) left;
+        }
+    }
+    uint64_t now = rendered_frames;
+    pthread_mutex_unlock(&schedule_lock);
+
+    // Realtime callbacks never wait, and never block on the pool either; only renderers
+    // that are allowed to wait, which are the offline ones, split mixes across it
+    int max_tasks = wait ? mix_pool.num_threads + 1 : 1;
+
+    unsigned done = 0;
+    while (done < frames) {
+        unsigned length = frames - done;
+        if (length > MIX_BLOCK_SIZE) length = MIX_BLOCK_SIZE;
+
+        // Late events take effect right away; the next pending one splits the block
+        pthread_mutex_lock(&schedule_lock);
+        while (events_count && events[events_head].frame <= now) {
+            event_t *event = events + events_head;
+            if (event->type == EVENT_VOICE) {
+                voices[event->channel] = event->voice;
+            } else {
+                uint64_t serial = (atomic_load_explicit(&now_playing, memory_order_relaxed) >> 32) + 1;
+                atomic_store_explicit(&now_playing, (serial << 32) | event->position, memory_order_release);
+            }
+
+            events_head = (events_head + 1) % EVENT_QUEUE_SIZE;
+            --events_count;
+        }
+
+        if (events_count && events[events_head].frame - now < length) {
+            length = (unsigned) (events[events_head].frame - now);
+        }
+        pthread_mutex_unlock(&schedule_lock);
+
+        mix_block(out + done * output_channels, length, max_tasks);
+
+        done += length;
+        now += length;
+    }
+
+    pthread_mutex_lock(&schedule_lock);
+    rendered_frames = now;
+    pthread_cond_broadcast(&rendered_cond);
+    pthread_mutex_unlock(&schedule_lock);
+
+    return frames;
+}
+
+uint64_t s3m_audio_position(void) {
+    pthread_mutex_lock(&schedule_lock);
+    uint64_t position = rendered_frames;
+    pthread_mutex_unlock(&schedule_lock);
+
+    return position;
+}
 
-    if (!resample_cache[instr][bnote]) {
-        float *data_out = malloc(output_length * sizeof(float));
+void s3m_audio_wait(uint64_t frame) {
+    pthread_mutex_lock(&schedule_lock);
+    while (frame >= rendered_frames + schedule_ahead) {
+        pthread_cond_wait(&rendered_cond, &schedule_lock);
+    }
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+void s3m_audio_advance(uint64_t frame) {
+    pthread_mutex_lock(&schedule_lock);
+    scheduled_frames = frame;
+    pthread_cond_broadcast(&scheduled_cond);
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+void s3m_audio_drain(uint64_t frame) {
+    pthread_mutex_lock(&schedule_lock);
+    while (rendered_frames < frame) {
+        pthread_cond_wait(&rendered_cond, &schedule_lock);
+    }
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+void s3m_audio_finish(uint64_t end) {
+    pthread_mutex_lock(&schedule_lock);
+    schedule_finished = 1;
+    schedule_end = end;
+    scheduled_frames = end;
+    pthread_cond_broadcast(&scheduled_cond);
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+static event_t *push_event(uint64_t frame, event_type_t type) {
+    while (events_count == EVENT_QUEUE_SIZE) {
+        pthread_cond_wait(&rendered_cond, &schedule_lock);
+    }
+
+    event_t *event = events + (events_head + events_count) % EVENT_QUEUE_SIZE;
+    event->frame = frame;
+    event->type = type;
+    ++events_count;
+
+    return event;
+}
+
+static void schedule_voice(uint64_t frame, int channel, const voice_t *voice) {
+    pthread_mutex_lock(&schedule_lock);
+
+    event_t *event = push_event(frame, EVENT_VOICE);
+    event->channel = channel;
+    event->voice = *voice;
+
+    pthread_cond_broadcast(&scheduled_cond);
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+void s3m_audio_silence(uint64_t frame) {
+    voice_t silence = {0};
+
+    for (int i = 0; i < NUM_CHANNELS; ++i) {
+        schedule_voice(frame, i, &silence);
+    }
+}
+
+void s3m_audio_mark(uint64_t frame, uint32_t position) {
+    pthread_mutex_lock(&schedule_lock);
+
+    event_t *event = push_event(frame, EVENT_POSITION);
+    event->position = position;
 
-        SRC_DATA data = {
-            .data_in = vinstr->sample,
-            .input_frames = vinstr->sample_length,
-            .data_out = data_out,
-            .output_frames = output_length,
-            .src_ratio = ratio
+    pthread_cond_broadcast(&scheduled_cond);
+    pthread_mutex_unlock(&schedule_lock);
+}
+
+uint64_t s3m_audio_now_playing(void) {
+    return atomic_load_explicit(&now_playing, memory_order_acquire);
+}
+
+static double time_mix(int num_tasks) {
+    int16_t out[MIX_BLOCK_SIZE * MIX_MAX_CHANNELS];
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < MIX_CALIBRATION_ROUNDS; ++i) mix_block(out, MIX_BLOCK_SIZE, num_tasks);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Mixes every channel, looping over a silent block, first on one thread and then split
+// across the whole pool. With perfect scaling the split would take serial / tasks; the
+// rest is the round trip, and a task must carry at least that much mixing to pay for it.
+static void calibrate_mix(void) {
+    static int16_t silence[MIX_BLOCK_SIZE + 1];
+
+    for (int i = 0; i < NUM_CHANNELS; ++i) {
+        voices[i] = (voice_t) {
+            .data = silence,
+            .volume = 1,
+            .pan = i % MIX_NUM_BUSES,
+            .end = ((uint64_t) MIX_BLOCK_SIZE) << FP_SHIFT,
+            .loop_length = ((uint64_t) MIX_BLOCK_SIZE) << FP_SHIFT
         };
+    }
+
+    int num_tasks = mix_pool.num_threads + 1;
+    mix_min_work_per_task = 1;
+
+    // The best of a few alternating runs, to leave out preemption and cold caches
+    double serial = 0;
+    double split = 0;
+    for (int i = 0; i < MIX_CALIBRATION_RUNS; ++i) {
+        double time = time_mix(1);
+        if (!i || time < serial) serial = time;
+
+        time = time_mix(num_tasks);
+        if (!i || time < split) split = time;
+    }
+
+    double work = (double) NUM_CHANNELS * MIX_BLOCK_SIZE;
+    double round_trip = split - serial / num_tasks;
+    double threshold = round_trip > 0 ? round_trip / serial * work : 0;
+
+    if (threshold < MIX_BLOCK_SIZE) threshold = MIX_BLOCK_SIZE;
+    mix_min_work_per_task = threshold < UINT_MAX ? (unsigned) threshold : UINT_MAX;
+
+    memset(voices, 0, sizeof(voices));
+}
+
+unsigned s3m_audio_mix_threshold(void) {
+    return mix_min_work_per_task;
+}
+
+int s3m_init_audio(const s3m_output_config_t *config, int mix_threads) {
+    assert(mix_threads >= 1 && mix_threads <= MIX_MAX_TASKS);
 
-        int status = src_simple(&data, SRC_SINC_BEST_QUALITY, 1);
-        if (status) {
-            fprintf(stderr, "Unable to convert sample %s: %s. Ratio: %g\n", vinstr->title, 
-                    src_strerror(status), ratio
-            );
-            return;
+    output_rate = config->rate;
+    output_channels = config->channels;
+    schedule_ahead = 2 * (uint64_t) config->buffer_frames;
+
+    atomic_init(&now_playing, 0);
+
+    // Constant power pan law, so a hard-panned channel plays at the level it has in mono
+    for (int p = 0; p <= S3M_PAN_MAX; ++p) {
+        double angle = p * M_PI / (2 * S3M_PAN_MAX);
+        pan_gains[p][0] = (int32_t) lround(PAN_ONE * cos(angle));
+        pan_gains[p][1] = (int32_t) lround(PAN_ONE * sin(angle));
+    }
+    pan_gains[S3M_PAN_MONO][0] = PAN_ONE;
+    pan_gains[S3M_PAN_MONO][1] = PAN_ONE;
+
+    // The rendering thread takes one share of the work itself
+    s3m_pool_start(&mix_pool, mix_threads - 1);
+    for (int i = 0; i <= mix_pool.num_threads; ++i) {
+        if (i) {
+            task_mix[i] = malloc(MIX_BLOCK_SIZE * MIX_MAX_CHANNELS * sizeof(int32_t));
+            assert(task_mix[i]);
         }
 
-        for (unsigned i = 0; i < output_length; ++i) {
-            data_out[i] /= 2;
+        if (output_channels > 1) {
+            task_buses[i] = malloc(MIX_NUM_BUSES * MIX_BLOCK_SIZE * sizeof(int32_t));
+            assert(task_buses[i]);
         }
+    }
 
-        int16_t *pcm = calloc(output_length, sizeof(int16_t));
-        src_float_to_short_array(data_out, pcm, consv_output_length);
+    if (mix_pool.num_threads) calibrate_mix();
 
-        resample_cache[instr][bnote] = pcm;
+    return 0;
+}
+
+static double get_ratio(s3m_vinstrument_t *vinstr, uint8_t bnote) {
+    return output_rate / s3m_get_note_freq(vinstr, bnote);
+}
+
+static int16_t *get_resampled(s3m_t *s3m, s3m_vinstrument_t *vinstr, uint8_t instr, uint8_t bnote,
+        unsigned *length) {
+    double ratio = get_ratio(vinstr, bnote);
+    unsigned output_length = (unsigned) ceil(vinstr->sample_length * ratio);
+    unsigned consv_output_length = (unsigned) floor(vinstr->sample_length * ratio);
 
+    *length = consv_output_length;
+
+    int16_t *_Atomic *entry = s3m->resample_cache + instr * S3M_NUM_NOTES + bnote;
+
+    int16_t *pcm = atomic_load_explicit(entry, memory_order_acquire);
+    if (pcm) return pcm;
+
+    float *data_out = malloc(output_length * sizeof(float));
+
+    SRC_DATA data = {
+        .data_in = vinstr->sample,
+        .input_frames = vinstr->sample_length,
+        .data_out = data_out,
+        .output_frames = output_length,
+        .src_ratio = ratio
+    };
+
+    int status = src_simple(&data, SRC_SINC_BEST_QUALITY, 1);
+    if (status) {
+        fprintf(stderr, "Unable to convert sample %s: %s. Ratio: %g\n", vinstr->title, 
+                src_strerror(status), ratio
+        );
         free(data_out);
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < output_length; ++i) {
+        data_out[i] /= 2;
+    }
+
+    // The loader and the player may race to convert the same note. Only the winner takes
+    // space for it, since the module's chunks are never given back before it closes.
+    pthread_mutex_lock(&s3m->resample_lock);
+    pcm = atomic_load_explicit(entry, memory_order_relaxed);
+    if (!pcm) {
+        // One spare sample keeps interpolation at the very end of the buffer in bounds
+        unsigned padded_length = output_length + 1;
+        pcm = s3m_alloc_resampled(s3m, padded_length * sizeof(int16_t));
+
+        src_float_to_short_array(data_out, pcm, consv_output_length);
+        memset(pcm + consv_output_length, 0, (padded_length - consv_output_length) * sizeof(int16_t));
+
+        atomic_store_explicit(entry, pcm, memory_order_release);
     }
+    pthread_mutex_unlock(&s3m->resample_lock);
+
+    free(data_out);
+
+    return pcm;
+}
+
+void s3m_prepare_sample(s3m_t *s3m, uint8_t instr, uint8_t bnote) {
+    if ((bnote >> 4) == 0xF || bnote >= S3M_NUM_NOTES) return;
+
+    s3m_vinstrument_t *vinstr = s3m_load_instrument(s3m, instr);
+    if (!vinstr) return;
+
+    unsigned length;
+    get_resampled(s3m, vinstr, instr, bnote, &length);
+}
+
+void s3m_play_sample(uint64_t frame, int channel, s3m_t *s3m, uint8_t instr, uint8_t bnote,
+        uint8_t volume) {
+    if ((bnote >> 4) == 0xF) {
+        voice_t silence = {0};
+        schedule_voice(frame, channel, &silence);
+        return;
+    }
+
+    if (bnote >= S3M_NUM_NOTES) return;
+    if (s3m->hdr->channel_settings[channel] & S3M_CHANNEL_DISABLED) return;
+
+    s3m_vinstrument_t *vinstr = s3m_load_instrument(s3m, instr);
+    if (!vinstr) return;
+
+    unsigned length;
+    int16_t *pcm = get_resampled(s3m, vinstr, instr, bnote, &length);
+    if (!pcm) return;
+
+    voice_t voice = {
+        .data = pcm,
+        .volume = volume * 2,
+        .pan = s3m->pan[channel],
+        .position = 0,
+        .end = ((uint64_t) length) << FP_SHIFT,
+        .loop_length = 0
+    };
+
+    uint32_t loop_begin = vinstr->on_disk.loop_begin;
+    uint32_t loop_end = vinstr->on_disk.loop_end;
+    if (loop_end > vinstr->sample_length) loop_end = vinstr->sample_length;
+
+    if ((vinstr->on_disk.flags & INSTRUMENT_FLAG_LOOP) && loop_begin < loop_end) {
+        double ratio = get_ratio(vinstr, bnote);
+
+        uint64_t begin = (uint64_t) (loop_begin * ratio * FP_ONE);
+        uint64_t end = (uint64_t) (loop_end * ratio * FP_ONE);
+        if (end > voice.end) end = voice.end;
+
+        if (begin < end) {
+            voice.end = end;
+            voice.loop_length = end - begin;
+        }
+    }
+
+    schedule_voice(frame, channel, &voice);
+}
+
+// Plays PCM that is already at the output rate, centred, as a note would play at volume
+void s3m_play_pcm(uint64_t frame, int channel, const int16_t *pcm, unsigned length,
+        uint8_t volume) {
+    voice_t voice = {
+        .data = pcm,
+        .volume = volume * 2,
+        .pan = S3M_PAN_MONO,
+        .position = 0,
+        .end = ((uint64_t) length) << FP_SHIFT,
+        .loop_length = 0
+    };
 
-    channels[channel].abuf = (uint8_t *) resample_cache[instr][bnote];
-    channels[channel].alen = consv_output_length * sizeof(int16_t);
-    channels[channel].volume = (uint8_t) volume * 2;
-    Mix_PlayChannel(channel, channels + channel, 0);
+    schedule_voice(frame, channel, &voice);
 }
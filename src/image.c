@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "s3m.h"
+
+static size_t get_vinstr_size(s3m_vinstrument_t *vinstr) {
+    return offsetof(s3m_vinstrument_t, sample) + vinstr->sample_length * sizeof(float);
+}
+
+static int in_bounds(uint64_t offset, uint64_t length, uint64_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+int s3m_is_image(const void *buf, size_t size) {
+    return size >= sizeof(s3m_image_header_t)
+        && !memcmp(buf, S3M_IMAGE_MAGIC, sizeof(S3M_IMAGE_MAGIC) - 1);
+}
+
+s3m_error_t s3m_open_image(void *buf, size_t size, s3m_t *s3m) {
+    assert(buf);
+    assert(s3m);
+
+    uint8_t *u8 = buf;
+    s3m_image_header_t *img = buf;
+
+    if (!s3m_is_image(buf, size)) {
+        return S3M_E_BAD_IMAGE_MAGIC;
+    }
+
+    if (img->version != S3M_IMAGE_VERSION || img->byte_order != S3M_IMAGE_BYTE_ORDER
+            || img->vinstrument_size != sizeof(s3m_vinstrument_t)) {
+        return S3M_E_BAD_IMAGE_VERSION;
+    }
+
+    if (img->size != size
+            || !in_bounds(img->header_offset, img->header_size, size)
+            || img->header_size < sizeof(s3m_header_t)) {
+        return S3M_E_BAD_IMAGE;
+    }
+
+    s3m->hdr = (s3m_header_t *) (u8 + img->header_offset);
+    s3m->orders = u8 + img->header_offset + sizeof(s3m_header_t);
+
+    uint16_t num_instruments = s3m->hdr->num_instruments;
+    uint16_t num_patterns = s3m->hdr->num_patterns;
+
+    if (img->header_size < s3m_get_header_size(s3m)
+            || !in_bounds(img->instruments_offset, num_instruments * sizeof(uint64_t), size)
+            || !in_bounds(img->patterns_offset, num_patterns * sizeof(uint64_t), size)
+            || img->instruments_offset % sizeof(uint64_t)
+            || img->patterns_offset % sizeof(uint64_t)) {
+        return S3M_E_BAD_IMAGE;
+    }
+
+    uint64_t *instrument_offsets = (uint64_t *) (u8 + img->instruments_offset);
+    uint64_t *pattern_offsets = (uint64_t *) (u8 + img->patterns_offset);
+
+    for (uint16_t i = 0; i < num_instruments; ++i) {
+        uint64_t offset = instrument_offsets[i];
+        if (offset % sizeof(uint64_t) || !in_bounds(offset, offsetof(s3m_vinstrument_t, sample), size)) {
+            return S3M_E_BAD_IMAGE;
+        }
+
+        s3m_vinstrument_t *vinstr = (s3m_vinstrument_t *) (u8 + offset);
+        if (!in_bounds(offset, get_vinstr_size(vinstr), size)) {
+            return S3M_E_BAD_IMAGE;
+        }
+    }
+
+    for (uint16_t i = 0; i < num_patterns; ++i) {
+        if (pattern_offsets[i] && !in_bounds(pattern_offsets[i], S3M_PATTERN_SIZE, size)) {
+            return S3M_E_BAD_IMAGE;
+        }
+    }
+
+    s3m->tempo = s3m->hdr->initial_tempo;
+    s3m->speed = s3m->hdr->initial_speed;
+
+    s3m_read_pan(s3m);
+
+    // Only the tables live outside the mapping; everything they point to is shared
+    s3m_alloc_arena(s3m, 0);
+
+    for (uint16_t i = 0; i < num_instruments; ++i) {
+        s3m->instruments[i] = (s3m_vinstrument_t *) (u8 + instrument_offsets[i]);
+        atomic_store(&s3m->instrument_loaded[i], 1);
+    }
+
+    for (uint16_t i = 0; i < num_patterns; ++i) {
+        s3m->patterns[i] = pattern_offsets[i] ? (s3m_cell_t *) (u8 + pattern_offsets[i]) : NULL;
+        atomic_store(&s3m->pattern_loaded[i], 1);
+    }
+
+    return S3M_OK;
+}
+
+static int write_data(FILE *out, const void *data, size_t length, uint64_t *position) {
+    if (length && fwrite(data, length, 1, out) != 1) return -1;
+    *position += length;
+
+    return 0;
+}
+
+static int write_aligned(FILE *out, const void *data, size_t length, uint64_t *position) {
+    static const uint8_t padding[S3M_IMAGE_ALIGNMENT] = {0};
+
+    if (write_data(out, data, length, position)) return -1;
+
+    size_t padding_length = S3M_ALIGN(*position, S3M_IMAGE_ALIGNMENT) - *position;
+    if (padding_length && fwrite(padding, padding_length, 1, out) != 1) return -1;
+    *position += padding_length;
+
+    return 0;
+}
+
+int s3m_write_image(s3m_t *s3m, FILE *out) {
+    uint16_t num_instruments = s3m->hdr->num_instruments;
+    uint16_t num_patterns = s3m->hdr->num_patterns;
+
+    for (uint16_t i = 0; i < num_instruments; ++i) s3m_load_instrument(s3m, i);
+    for (uint16_t i = 0; i < num_patterns; ++i) s3m_load_pattern(s3m, i);
+
+    uint64_t *instrument_offsets = calloc(num_instruments + 1, sizeof(uint64_t));
+    uint64_t *pattern_offsets = calloc(num_patterns + 1, sizeof(uint64_t));
+    assert(instrument_offsets);
+    assert(pattern_offsets);
+
+    s3m_image_header_t img = {
+        .magic = S3M_IMAGE_MAGIC,
+        .version = S3M_IMAGE_VERSION,
+        .byte_order = S3M_IMAGE_BYTE_ORDER,
+        .vinstrument_size = sizeof(s3m_vinstrument_t)
+    };
+
+    // Lay everything out first so the image can be written front to back
+    uint64_t position = S3M_ALIGN(sizeof(s3m_image_header_t), S3M_IMAGE_ALIGNMENT);
+
+    img.header_offset = position;
+    img.header_size = s3m_get_header_size(s3m);
+    position = S3M_ALIGN(position + img.header_size, S3M_IMAGE_ALIGNMENT);
+
+    img.instruments_offset = position;
+    position = S3M_ALIGN(position + num_instruments * sizeof(uint64_t), S3M_IMAGE_ALIGNMENT);
+
+    img.patterns_offset = position;
+    position = S3M_ALIGN(position + num_patterns * sizeof(uint64_t), S3M_IMAGE_ALIGNMENT);
+
+    for (uint16_t i = 0; i < num_instruments; ++i) {
+        instrument_offsets[i] = position;
+        position = S3M_ALIGN(position + get_vinstr_size(s3m->instruments[i]), S3M_IMAGE_ALIGNMENT);
+    }
+
+    for (uint16_t i = 0; i < num_patterns; ++i) {
+        if (!s3m->patterns[i]) continue;
+
+        pattern_offsets[i] = position;
+        position = S3M_ALIGN(position + S3M_PATTERN_SIZE, S3M_IMAGE_ALIGNMENT);
+    }
+
+    img.size = position;
+
+    position = 0;
+    int status = write_aligned(out, &img, sizeof(img), &position);
+    if (!status) status = write_aligned(out, s3m->hdr, img.header_size, &position);
+    if (!status) status = write_aligned(out, instrument_offsets, num_instruments * sizeof(uint64_t), &position);
+    if (!status) status = write_aligned(out, pattern_offsets, num_patterns * sizeof(uint64_t), &position);
+
+    for (uint16_t i = 0; i < num_instruments && !status; ++i) {
+        s3m_vinstrument_t *vinstr = s3m->instruments[i];
+
+        // Copied field by field so the struct padding is written as zeroes
+        s3m_vinstrument_t record;
+        memset(&record, 0, sizeof(record));
+        record.on_disk = vinstr->on_disk;
+        memcpy(record.title, vinstr->title, sizeof(record.title));
+        record.sample_length = vinstr->sample_length;
+
+        // The sample follows the record directly, as in memory
+        status = write_data(out, &record, offsetof(s3m_vinstrument_t, sample), &position);
+        if (!status) {
+            status = write_aligned(out, vinstr->sample, vinstr->sample_length * sizeof(float), &position);
+        }
+    }
+
+    for (uint16_t i = 0; i < num_patterns && !status; ++i) {
+        if (!s3m->patterns[i]) continue;
+
+        status = write_aligned(out, s3m->patterns[i], S3M_PATTERN_SIZE, &position);
+    }
+
+    free(instrument_offsets);
+    free(pattern_offsets);
+
+    assert(status || position == img.size);
+    return status;
+}
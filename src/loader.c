@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "s3m.h"
+
+// Decodes a pattern and resamples every note it plays
+void s3m_prepare_pattern(s3m_t *s3m, uint16_t i) {
+    s3m_cell_t *pattern = s3m_load_pattern(s3m, i);
+    if (!pattern) return;
+
+    for (int r = 0; r < S3M_NUM_ROWS_PER_PATTERN; ++r) {
+        for (int c = 0; c < S3M_NUM_CHANNELS; ++c) {
+            s3m_cell_t *cell = s3m_get_cell(pattern, c, r);
+
+            if (cell->raw && cell->instrument) {
+                s3m_prepare_sample(s3m, cell->instrument - 1, cell->note);
+            }
+        }
+    }
+}
+
+static int prepare_order(s3m_t *s3m, unsigned order) {
+    if (order >= s3m->hdr->num_orders || s3m->orders[order] == S3M_ORDER_END) return 0;
+
+    s3m_prepare_pattern(s3m, s3m->orders[order]);
+    return 1;
+}
+
+static void *loader_main(void *arg) {
+    s3m_loader_t *loader = arg;
+
+    // Each worker claims the next order entry, so work is handed out in playback order
+    // and the prepared region keeps growing ahead of the playhead.
+    while (prepare_order(loader->s3m, atomic_fetch_add(&loader->next_order, 1)));
+
+    pthread_mutex_lock(&loader->lock);
+    loader->claimed = 1;
+    pthread_cond_broadcast(&loader->claimed_cond);
+    pthread_mutex_unlock(&loader->lock);
+
+    return NULL;
+}
+
+void s3m_loader_start(s3m_loader_t *loader, s3m_t *s3m, int num_threads) {
+    assert(loader);
+    assert(s3m);
+
+    loader->s3m = s3m;
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->claimed_cond, NULL);
+    loader->claimed = 0;
+
+    // Whatever the first order entry needs is prepared right away so playback can begin
+    unsigned first = 0;
+    while (first < s3m->hdr->num_orders && s3m->orders[first] == S3M_ORDER_SKIP) ++first;
+    prepare_order(s3m, first);
+
+    atomic_init(&loader->next_order, first + 1);
+
+    if (num_threads < 1) num_threads = 1;
+
+    loader->threads = calloc(num_threads, sizeof(pthread_t));
+    assert(loader->threads);
+
+    loader->num_threads = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        if (pthread_create(loader->threads + i, NULL, loader_main, loader)) {
+            fprintf(stderr, "Warning: unable to start loader thread %d.\n", i);
+            break;
+        }
+
+        ++loader->num_threads;
+    }
+
+    // Without any worker, fall back to preparing everything up front
+    if (!loader->num_threads) loader_main(loader);
+}
+
+void s3m_loader_wait_claimed(s3m_loader_t *loader) {
+    pthread_mutex_lock(&loader->lock);
+    while (!loader->claimed) {
+        pthread_cond_wait(&loader->claimed_cond, &loader->lock);
+    }
+    pthread_mutex_unlock(&loader->lock);
+}
+
+void s3m_loader_join(s3m_loader_t *loader) {
+    for (int i = 0; i < loader->num_threads; ++i) {
+        pthread_join(loader->threads[i], NULL);
+    }
+
+    free(loader->threads);
+    loader->threads = NULL;
+    loader->num_threads = 0;
+
+    pthread_cond_destroy(&loader->claimed_cond);
+    pthread_mutex_destroy(&loader->lock);
+}
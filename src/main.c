@@ -4,35 +4,175 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <libgen.h>
+#include <math.h>
 
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-
-#include <SDL_mixer.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "slopt/opt.h"
 
 #include "s3m.h"
 
-#define FLAG_SILENT (1 << 0)
+#define BENCH_RSS_INTERVAL 100
+#define BENCH_RSS_TOLERANCE_KIB 256
 
-static int BAR_COLORS[] = {
-    196, 202, 208, 214, 220, 226, 190, 154, 118, 82, 46
-};
+// Every client of the serve test must receive the configured rate to within the tolerance.
+// The slow client reads for a while between its pauses, and the server is closed a margin
+// after it should have been dropped.
+#define SERVE_TEST_TOLERANCE 0.1
+#define SERVE_TEST_MAX_CLIENTS 256
+#define SERVE_TEST_READ_SECONDS 1
+#define SERVE_TEST_MARGIN_SECONDS 2
+#define SERVE_TEST_SLOW_BUFFER 4096
 
+// slopt matches long names by prefix, so a name must come before any name it starts with
 static slopt_Option options[] = {
-    {'w', "--wrap", SLOPT_DISALLOW_ARGUMENT},
+    {'w', "wrap", SLOPT_DISALLOW_ARGUMENT},
+    {'n', "no-ui", SLOPT_DISALLOW_ARGUMENT},
+    {'j', "mix-threads", SLOPT_REQUIRE_ARGUMENT},
+    {'f', "output-file", SLOPT_REQUIRE_ARGUMENT},
+    {'o', "output", SLOPT_REQUIRE_ARGUMENT},
+    {'T', "serve-test", SLOPT_REQUIRE_ARGUMENT},
+    {'s', "serve", SLOPT_REQUIRE_ARGUMENT},
+    {'r', "rate", SLOPT_REQUIRE_ARGUMENT},
+    {'b', "buffer-frames", SLOPT_REQUIRE_ARGUMENT},
+    {'c', "channels", SLOPT_REQUIRE_ARGUMENT},
+    {'C', "compile", SLOPT_DISALLOW_ARGUMENT},
+    {'B', "bench", SLOPT_REQUIRE_ARGUMENT},
+    {'p', "playlist", SLOPT_REQUIRE_ARGUMENT},
+    {'l', "loop-count", SLOPT_REQUIRE_ARGUMENT},
     {0, NULL, 0}
 };
 
-static const char *path = NULL;
+// A module in the playlist, from the mapped file to the loader that decodes it
+typedef struct track {
+    const char *path;
+    int ok;
+
+    void *file;
+    size_t size;
+    s3m_t s3m;
+    s3m_loader_t loader;
+
+    // The track playing before this one, whose loader has the machine first
+    struct track *previous;
+    pthread_t prefetch;
+    int prefetching;
+} track_t;
+
+// A loopback listener of the serve test
+typedef struct test_client {
+    int fd;
+    pthread_t thread;
+
+    // A slow client stops reading twice: long enough to be skipped ahead, then for good
+    int slow;
+    double pause;
+
+    uint64_t bytes;
+    uint64_t first_bytes;
+    struct timespec first;
+    struct timespec last;
+    struct timespec closed;
+
+    // Every whole block received is hashed, so that the clients' streams can be compared
+    size_t block_size;
+    size_t block_fill;
+    uint64_t hash;
+    uint64_t *hashes;
+    size_t num_hashes;
+    size_t hashes_size;
+} test_client_t;
+
+static char **paths = NULL;
+static int num_paths = 0;
+static int compile = 0;
+static int loop_count = -1;
+static int bench_count = 0;
+static int serve_test_clients = 0;
 static int wrap = 0;
+static int mix_threads = 1;
+static int show_ui = 1;
+
+static const s3m_output_t *output = NULL;
+static s3m_output_config_t output_config = {
+    .rate = 48000,
+    .buffer_frames = 1024,
+    .channels = 2,
+    .path = "-",
+    .port = 0
+};
 
 static void usage(const char *pname) {
-    printf("Usage: %s FILE\n", pname);
+    printf("Usage: %s [-w] [-n] [-j THREADS] [-o sdl|raw|null|serve] [-f PATH] [-s PORT] [-r RATE]\n"
+        "       [-b FRAMES] [-c 1|2] [-l COUNT] [-p PLAYLIST] FILE...\n",
+        pname
+    );
+    printf("       %s --compile FILE OUTPUT\n", pname);
+    printf("       %s --bench COUNT FILE\n", pname);
+    printf("       %s --serve-test CLIENTS -s PORT\n", pname);
+}
+
+static int parse_number(char sname, const char *value, int min, int max) {
+    char *end;
+    long number = strtol(value, &end, 10);
+
+    if (!*value || *end || number < min || number > max) {
+        fprintf(stderr, "The -%c option requires a number from %d to %d.\n", sname, min, max);
+        exit(9);
+    }
+
+    return (int) number;
+}
+
+static void add_path(const char *path) {
+    paths = realloc(paths, (num_paths + 1) * sizeof(char *));
+    assert(paths);
+
+    paths[num_paths] = strdup(path);
+    assert(paths[num_paths]);
+    ++num_paths;
+}
+
+// One module per line; blank lines and lines starting with # are skipped. Relative paths
+// are taken from the directory of the playlist.
+static void read_playlist(const char *playlist_path) {
+    FILE *playlist = fopen(playlist_path, "r");
+    if (!playlist) {
+        fprintf(stderr, "Unable to open %s. %s.\n", playlist_path, strerror(errno));
+        exit(16);
+    }
+
+    char *dir_buffer = strdup(playlist_path);
+    assert(dir_buffer);
+    const char *dir = dirname(dir_buffer);
+
+    char line[4096];
+    while (fgets(line, sizeof(line), playlist)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!*line || *line == '#') continue;
+
+        if (*line == '/') {
+            add_path(line);
+            continue;
+        }
+
+        char path[sizeof(line) + 4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, line);
+        add_path(path);
+    }
+
+    free(dir_buffer);
+    fclose(playlist);
 }
 
 static void on_option(int sw, char sname, const char *lname, const char *value, void *pl) {
@@ -43,6 +183,63 @@ static void on_option(int sw, char sname, const char *lname, const char *value,
                 case 'w':
                     wrap = 1;
                     break;
+
+                case 'n':
+                    show_ui = 0;
+                    break;
+
+                case 'j':
+                    mix_threads = parse_number(sname, value, 1, S3M_MAX_MIX_THREADS);
+                    break;
+
+                case 'o':
+                    output = s3m_find_output(value);
+                    if (!output) {
+                        fprintf(stderr, "Unknown output %s.\n", value);
+                        usage(pl);
+                        exit(10);
+                    }
+                    break;
+
+                case 'f':
+                    output_config.path = value;
+                    break;
+
+                case 's':
+                    output_config.port = parse_number(sname, value, 1, 65535);
+                    break;
+
+                case 'r':
+                    output_config.rate = parse_number(sname, value, 8000, 192000);
+                    break;
+
+                case 'b':
+                    output_config.buffer_frames = parse_number(sname, value, 16, 16384);
+                    break;
+
+                case 'c':
+                    output_config.channels = parse_number(sname, value, 1, 2);
+                    break;
+
+                case 'C':
+                    compile = 1;
+                    break;
+
+                case 'B':
+                    bench_count = parse_number(sname, value, 1, 100000000);
+                    break;
+
+                case 'T':
+                    serve_test_clients = parse_number(sname, value, 1, SERVE_TEST_MAX_CLIENTS);
+                    break;
+
+                case 'p':
+                    read_playlist(value);
+                    break;
+
+                case 'l':
+                    loop_count = parse_number(sname, value, 1, 1000000);
+                    break;
             }
             break;
 
@@ -67,123 +264,668 @@ static void on_option(int sw, char sname, const char *lname, const char *value,
             exit(4);
 
         case SLOPT_DIRECT:
-            if (path) {
-                fprintf(stderr, "Only one file can be opened per instance.\n");
-                exit(5);
-            }
-
-            path = value;
+            add_path(value);
             break;
     }
 }
 
-static void play_pattern(s3m_t *s3m, uint16_t i, struct timespec *tv, int flags) {
-    if (!s3m->patterns[i]) return;
+static int play_order(s3m_t *s3m, uint8_t tag, uint16_t order, double *clock) {
+    uint8_t i = s3m->orders[order];
+
+    s3m_cell_t *pattern = s3m_load_pattern(s3m, i);
+    if (!pattern) return 0;
 
     for (int r = 0; r < S3M_NUM_ROWS_PER_PATTERN; ++r) {
-        if (flags ^ FLAG_SILENT) {
-            printf("\n\033[3%c;1m%2d.%2d\033[0m", '1' + (i % 6), i, r);
-        }
+        // Outputs that cannot wait keep going when the player falls behind. Overdue rows
+        // are shifted to the output position; otherwise they would all land on the same
+        // block and overwrite each other's notes.
+        uint64_t position = s3m_audio_position();
+        if (*clock < position) *clock = position;
 
-        for (int c = 0; c < 32; ++c) {
-            s3m_cell_t *cell = s3m_get_cell(s3m->patterns[i], c, r);
-            assert(cell);
+        uint64_t frame = (uint64_t) *clock;
+        s3m_audio_wait(frame);
 
-            size_t cell_text_size = 128;
-            char cell_text[cell_text_size];
-            s3m_cell_to_text(cell, cell_text, cell_text_size);
+        s3m_audio_mark(frame, S3M_POSITION(tag, order, i, r));
+
+        for (int c = 0; c < S3M_NUM_CHANNELS; ++c) {
+            s3m_cell_t *cell = s3m_get_cell(pattern, c, r);
+            assert(cell);
 
+            s3m_vinstrument_t *vinstr = NULL;
             if (cell->raw && cell->instrument) {
-                s3m_vinstrument_t *vinstr = s3m->instruments[cell->instrument - 1];
+                vinstr = s3m_load_instrument(s3m, cell->instrument - 1);
+            }
 
+            if (vinstr) {
                 uint8_t volume = cell->volume;
                 if (!cell->volume) {
-                    volume = vinstr->on_disk->volume;
+                    volume = vinstr->on_disk.volume;
                 }
 
-                s3m_play_sample(c, s3m, cell->instrument - 1, cell->note, volume);
+                s3m_play_sample(frame, c, s3m, cell->instrument - 1, cell->note, volume);
             }
 
-            if (tv->tv_nsec && S3M_IS_EFFECT(cell->effect, 'T')) {
+            if (S3M_IS_EFFECT(cell->effect, 'T')) {
                 s3m->tempo = cell->effect_info;
-                tv->tv_nsec = s3m_tempo_to_ns(s3m);
             }
-
-            if (flags ^ FLAG_SILENT) printf(" | %s", cell_text);
         }
-        if (flags ^ FLAG_SILENT) fflush(stdout);
 
-        struct timespec ltv = *tv;
-        nanosleep(&ltv, NULL);
+        *clock += s3m_tempo_to_frames(s3m, output_config.rate);
+        s3m_audio_advance((uint64_t) *clock);
     }
+
+    return S3M_NUM_ROWS_PER_PATTERN;
 }
 
-int main(int argc, char **argv) {
-    s3m_init_audio();
+static void play_track(track_t *track, uint8_t tag, double *clock) {
+    s3m_t *s3m = &track->s3m;
 
-    slopt_parse(argc - 1, argv + 1, options, on_option, argv[0]);
+    for (int pass = 0; loop_count <= 0 || pass < loop_count; ++pass) {
+        int rows = 0;
+
+        for (uint16_t i = 0; i < s3m->hdr->num_orders && s3m->orders[i] != S3M_ORDER_END; ++i) {
+            if (s3m->orders[i] == S3M_ORDER_SKIP) continue;
+
+            rows += play_order(s3m, tag, i, clock);
+        }
 
+        // A module without a single row to play would otherwise loop forever
+        if (!rows) break;
+    }
+}
+
+static void *map_file(const char *path, size_t *size) {
     int fd = open(path, O_RDONLY);
     if (fd == -1) {
         fprintf(stderr, "Unable to open %s. %s.\n", path, strerror(errno));
-        exit(6);
+        return NULL;
     }
 
     struct stat file_info;
     int status = fstat(fd, &file_info);
     if (status == -1) {
         fprintf(stderr, "Unable to stat %s. %s.\n", path, strerror(errno));
-        exit(7);
+        close(fd);
+        return NULL;
     }
 
-    void *file = mmap(NULL, file_info.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    // Pages are faulted in as the loader reaches them; the hint only starts readahead early
+    void *file = mmap(NULL, file_info.st_size, PROT_READ, MAP_SHARED, fd, 0);
     if (file == MAP_FAILED) {
-        fprintf(stderr, "Unable to map %s. %s.", path, strerror(errno));
-        exit(8);
+        fprintf(stderr, "Unable to map %s. %s.\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    madvise(file, file_info.st_size, MADV_WILLNEED);
+
+    close(fd);
+
+    *size = file_info.st_size;
+    return file;
+}
+
+static s3m_error_t open_buffer(void *file, size_t size, s3m_t *s3m) {
+    // Compiled images are used in place, straight from the shared mapping
+    if (s3m_is_image(file, size)) {
+        return s3m_open_image(file, size, s3m);
+    }
+
+    return s3m_open(file, s3m);
+}
+
+static int open_module(const char *path, void **file, size_t *size, s3m_t *s3m) {
+    *file = map_file(path, size);
+    if (!*file) return 6;
+
+    s3m_error_t status = open_buffer(*file, *size, s3m);
+    if (status != S3M_OK) {
+        fprintf(stderr, "Unable to load %s. %s.\n", path, s3m_strerror(status));
+        munmap(*file, *size);
+        return 12;
+    }
+
+    return 0;
+}
+
+static int get_num_loader_threads(void) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 1 ? num_cpus - 1 : 1;
+}
+
+static int has_rows(s3m_t *s3m) {
+    for (uint16_t i = 0; i < s3m->hdr->num_orders && s3m->orders[i] != S3M_ORDER_END; ++i) {
+        if (s3m->orders[i] != S3M_ORDER_SKIP && s3m_load_pattern(s3m, s3m->orders[i])) return 1;
+    }
+
+    return 0;
+}
+
+static void close_track(track_t *track) {
+    if (!track->ok) return;
+
+    s3m_loader_join(&track->loader);
+    s3m_close(&track->s3m);
+    munmap(track->file, track->size);
+    track->ok = 0;
+}
+
+// A module without a single row to play is skipped like one that fails to load. It would
+// not move the clock, so the playlist could never tell where it ends.
+static void open_track(track_t *track) {
+    track->ok = !open_module(track->path, &track->file, &track->size, &track->s3m);
+    if (!track->ok) return;
+
+    s3m_loader_start(&track->loader, &track->s3m, get_num_loader_threads());
+
+    if (!has_rows(&track->s3m)) {
+        fprintf(stderr, "Nothing to play in %s.\n", track->path);
+        close_track(track);
     }
+}
+
+// Opens the next module once every order of the current one is being prepared, so the
+// two loaders never compete for orders the current module has yet to reach. The prefetch
+// is done as soon as the first order of the next module is ready; its loader keeps going
+// until close_track.
+static void *prefetch_main(void *arg) {
+    track_t *track = arg;
 
+    if (track->previous && track->previous->ok) s3m_loader_wait_claimed(&track->previous->loader);
+    open_track(track);
+
+    return NULL;
+}
+
+static void start_prefetch(track_t *track) {
+    track->prefetching = !pthread_create(&track->prefetch, NULL, prefetch_main, track);
+    if (!track->prefetching) {
+        fprintf(stderr, "Warning: unable to start the prefetch thread.\n");
+        prefetch_main(track);
+    }
+}
+
+static void join_prefetch(track_t *track) {
+    if (track->prefetching) pthread_join(track->prefetch, NULL);
+    track->prefetching = 0;
+}
+
+static int compile_module(const char *path, const char *out_path) {
+    void *file;
+    size_t size;
     s3m_t s3m;
-    status = s3m_open(file, &s3m);
-    assert(status == 0);
 
-    // Disable line wrapping
-    if (!wrap) {
-        printf("\033[?7l");
+    int open_status = open_module(path, &file, &size, &s3m);
+    if (open_status) return open_status;
+
+    FILE *out = fopen(out_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Unable to open %s. %s.\n", out_path, strerror(errno));
+        return 13;
     }
 
-    printf("Filling note cache...\n");
-    Mix_Volume(-1, 128);
-    char bar[41];
-    bar[40] = 0;
-    for (uint16_t i = 0; i < s3m.hdr->num_patterns; ++i) {
-        double progress = ((double) i) / s3m.hdr->num_patterns;
-        int iprogress = (int) ceil(progress * 40);
+    int status = s3m_write_image(&s3m, out);
+    s3m_close(&s3m);
+    munmap(file, size);
 
-        memset(bar, '#', iprogress);
-        memset(bar + iprogress, ' ', 40 - iprogress);
+    if (fclose(out) || status) {
+        fprintf(stderr, "Unable to write %s. %s.\n", out_path, strerror(errno));
+        return 14;
+    }
 
-        printf("\033[1K\033[1G%3d%% [\033[38;5;%dm%s\033[0m]",
-            (int) ceil(progress * 100), BAR_COLORS[(int) ceil(progress * 10)], bar
-        );
-        fflush(stdout);
+    return 0;
+}
+
+static long get_rss_kib(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+
+    long size = 0;
+    long resident = 0;
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(statm);
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
 
-        struct timespec tv = {0};
-        play_pattern(&s3m, i, &tv, FLAG_SILENT);
+static int bench_module(const char *path, int count) {
+    size_t size;
+    void *file = map_file(path, &size);
+    if (!file) return 6;
+
+    long rss_first = 0;
+    long rss_peak = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < count; ++i) {
+        s3m_t s3m;
+        s3m_error_t status = open_buffer(file, size, &s3m);
+        if (status != S3M_OK) {
+            fprintf(stderr, "Unable to load %s. %s.\n", path, s3m_strerror(status));
+            return 12;
+        }
+
+        // Decode everything and resample every note played, as the loader would over the
+        // course of the song
+        for (uint16_t k = 0; k < s3m.hdr->num_instruments; ++k) s3m_load_instrument(&s3m, k);
+        for (uint16_t k = 0; k < s3m.hdr->num_patterns; ++k) s3m_prepare_pattern(&s3m, k);
+
+        s3m_close(&s3m);
+
+        if (i % BENCH_RSS_INTERVAL == 0) {
+            long rss = get_rss_kib();
+            if (!i) rss_first = rss;
+            if (rss > rss_peak) rss_peak = rss;
+        }
     }
 
-    memset(bar, '#', 40);
-    printf("\033[1K\033[1G100%% [\033[38;5;46m%s\033[0m]", bar);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    struct timespec tv = {
-        .tv_sec = 0,
-        .tv_nsec = s3m_tempo_to_ns(&s3m)
-    };
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long rss_last = get_rss_kib();
+    if (rss_last > rss_peak) rss_peak = rss_last;
+
+    printf("%d open/close cycles in %.3f s, %.0f per second.\n", count, seconds, count / seconds);
+    printf("RSS after the first cycle %ld KiB, at the end %ld KiB, at most %ld KiB.\n",
+        rss_first, rss_last, rss_peak
+    );
+
+    if (rss_last > rss_first + BENCH_RSS_TOLERANCE_KIB) {
+        fprintf(stderr, "RSS grew by %ld KiB.\n", rss_last - rss_first);
+        return 15;
+    }
 
-    Mix_HaltChannel(-1);
-    Mix_Volume(-1, 128);
+    return 0;
+}
+
+static double seconds_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void sleep_for(double seconds) {
+    struct timespec time = {(time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9)};
+    while (nanosleep(&time, &time) && errno == EINTR);
+}
+
+// FNV-1a over each block, continued across reads
+static void hash_test_data(test_client_t *client, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (!client->block_fill) client->hash = 14695981039346656037ULL;
+        client->hash = (client->hash ^ data[i]) * 1099511628211ULL;
+
+        if (++client->block_fill < client->block_size) continue;
+        client->block_fill = 0;
+
+        if (client->num_hashes == client->hashes_size) {
+            client->hashes_size = client->hashes_size ? client->hashes_size * 2 : 256;
+            client->hashes = realloc(client->hashes, client->hashes_size * sizeof(uint64_t));
+            assert(client->hashes);
+        }
+        client->hashes[client->num_hashes++] = client->hash;
+    }
+}
+
+// Reads for the given time, or until the server closes if it is negative. Returns 0 once
+// the server has closed.
+static int read_test_client(test_client_t *client, double seconds) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint8_t buffer[65536];
     for (;;) {
-        for (uint16_t i = 0; i < s3m.hdr->num_orders && s3m.orders[i] != 255; ++i) {
-            play_pattern(&s3m, s3m.orders[i], &tv, 0);
+        if (seconds >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = seconds - seconds_between(&start, &now);
+            if (left <= 0) return 1;
+
+            struct pollfd readable = {.fd = client->fd, .events = POLLIN};
+            if (poll(&readable, 1, (int) (left * 1000) + 1) <= 0) continue;
+        }
+
+        ssize_t status = read(client->fd, buffer, sizeof(buffer));
+        if (status == -1 && errno == EINTR) continue;
+        if (status <= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &client->closed);
+            return 0;
+        }
+
+        // The rate is taken between the first and last reads
+        clock_gettime(CLOCK_MONOTONIC, &client->last);
+        if (!client->bytes) {
+            client->first = client->last;
+            client->first_bytes = status;
+        }
+        client->bytes += status;
+
+        hash_test_data(client, buffer, status);
+    }
+}
+
+static void *test_client_main(void *arg) {
+    test_client_t *client = arg;
+
+    int open = 1;
+    if (client->slow) {
+        open = read_test_client(client, SERVE_TEST_READ_SECONDS);
+        if (open) {
+            sleep_for(client->pause);
+            open = read_test_client(client, SERVE_TEST_READ_SECONDS);
+        }
+        if (open) sleep_for(S3M_SERVE_STALL_SECONDS + SERVE_TEST_MARGIN_SECONDS);
+    }
+    if (open) read_test_client(client, -1);
+
+    close(client->fd);
+    return NULL;
+}
+
+static int connect_test_client(test_client_t *client, int port) {
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd == -1) return 1;
+
+    // The slow client's window is kept small, so that the server soon has to wait for it
+    int buffer = SERVE_TEST_SLOW_BUFFER;
+    if (client->slow) setsockopt(client->fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+
+    if (connect(client->fd, (struct sockaddr *) &address, sizeof(address))
+            || pthread_create(&client->thread, NULL, test_client_main, client)) {
+        close(client->fd);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Finds each of a client's blocks in the reference stream, in order. Returns how often the
+// client skipped ahead, or -1 if its stream is not part of the reference. The reference may
+// have been closed a little earlier, so blocks past its end are not compared.
+static long count_test_skips(const test_client_t *client, const test_client_t *reference) {
+    if (!client->num_hashes) return -1;
+
+    long skips = 0;
+    size_t next = 0;
+    for (size_t i = 0; i < client->num_hashes; ++i) {
+        size_t found = next;
+        while (found < reference->num_hashes && reference->hashes[found] != client->hashes[i]) {
+            ++found;
+        }
+
+        if (found == reference->num_hashes) return i && next == found ? skips : -1;
+        if (i && found != next) ++skips;
+        next = found + 1;
+    }
+
+    return skips;
+}
+
+static int serve_test(int num_clients) {
+    double rate = output_config.rate;
+    size_t frame_size = output_config.channels * sizeof(int16_t);
+
+    // The slow client pauses for longer than the ring holds, but not for long enough to be
+    // dropped, unless the buffer makes the ring too long for that
+    double ring_seconds = (double) S3M_SERVE_RING_BLOCKS * output_config.buffer_frames / rate;
+    double pause = ring_seconds + 1;
+    int check_skip = pause + SERVE_TEST_MARGIN_SECONDS < S3M_SERVE_STALL_SECONDS;
+    if (!check_skip) pause = 0;
+
+    double seconds = 2 * SERVE_TEST_READ_SECONDS + pause + S3M_SERVE_STALL_SECONDS
+        + 2 * SERVE_TEST_MARGIN_SECONDS;
+
+    // Noise, so that every block differs and the clients' streams can be told apart
+    unsigned noise_length = (unsigned) ((seconds + 1) * rate);
+    int16_t *noise = malloc(noise_length * sizeof(int16_t));
+    assert(noise);
+
+    uint32_t state = 1;
+    for (unsigned i = 0; i < noise_length; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        noise[i] = (int16_t) state;
+    }
+    s3m_play_pcm(0, 0, noise, noise_length, 64);
+
+    if (output->open(&output_config)) {
+        free(noise);
+        return 11;
+    }
+
+    test_client_t *clients = calloc(num_clients + 1, sizeof(test_client_t));
+    assert(clients);
+
+    test_client_t *slow = clients + num_clients;
+    slow->slow = 1;
+    slow->pause = pause;
+
+    // Clients that could not connect are not started; the server is still closed cleanly
+    int connected = 0;
+    while (connected <= num_clients) {
+        clients[connected].block_size = output_config.buffer_frames * frame_size;
+        if (connect_test_client(clients + connected, output_config.port)) break;
+        ++connected;
+    }
+    if (connected <= num_clients) {
+        fprintf(stderr, "Unable to connect client %d. %s.\n", connected + 1, strerror(errno));
+    }
+
+    if (connected > num_clients) sleep_for(seconds);
+
+    struct timespec closed;
+    clock_gettime(CLOCK_MONOTONIC, &closed);
+    output->close();
+
+    double expected = rate * frame_size;
+    int failed = connected <= num_clients;
+
+    for (int i = 0; i < connected; ++i) pthread_join(clients[i].thread, NULL);
+
+    for (int i = 0; i < connected && i < num_clients; ++i) {
+        test_client_t *client = clients + i;
+
+        double elapsed = seconds_between(&client->first, &client->last);
+        double received = elapsed > 0 ? (client->bytes - client->first_bytes) / elapsed : 0;
+        long skips = count_test_skips(client, clients);
+
+        // The first client is the reference, so it must not repeat itself
+        int repeats = 0;
+        for (size_t j = 1; j < client->num_hashes; ++j) {
+            if (client->hashes[j] == client->hashes[j - 1]) repeats = 1;
+        }
+
+        int ok = fabs(received - expected) < expected * SERVE_TEST_TOLERANCE
+            && client->bytes % frame_size == 0 && skips == 0 && !repeats;
+
+        printf("Client %d: %llu bytes, %.0f bytes per second, %s, %s.\n", i + 1,
+            (unsigned long long) client->bytes, received,
+            skips == 0 && !repeats ? "same data" : "different data", ok ? "ok" : "FAILED"
+        );
+        if (!ok) failed = 1;
+    }
+
+    printf("Expected %.0f bytes per second in whole %zu-byte frames.\n", expected, frame_size);
+
+    // The slow client must have been skipped ahead, and dropped while the server was running
+    if (connected > num_clients) {
+        long skips = count_test_skips(slow, clients);
+        double early = seconds_between(&slow->closed, &closed);
+        int ok = skips >= (check_skip ? 1 : 0) && early > 0;
+
+        printf("Slow client: %llu bytes, ", (unsigned long long) slow->bytes);
+        if (skips < 0) {
+            printf("different data, ");
+        } else {
+            printf("skipped ahead %ld times, ", skips);
         }
+        if (early > 0) {
+            printf("dropped %.1f seconds before the end, ", early);
+        } else {
+            printf("not dropped, ");
+        }
+        printf("%s.\n", ok ? "ok" : "FAILED");
+        if (!check_skip) {
+            printf("The ring outlasts the stall timeout with this buffer, so skipping ahead "
+                "was not checked.\n");
+        }
+        if (!ok) failed = 1;
+    }
+
+    for (int i = 0; i <= num_clients; ++i) free(clients[i].hashes);
+    free(clients);
+    free(noise);
+    return failed ? 18 : 0;
+}
+
+int main(int argc, char **argv) {
+    slopt_parse(argc - 1, argv + 1, options, on_option, argv[0]);
+
+    if ((!num_paths && !serve_test_clients) || (serve_test_clients && num_paths)
+            || (compile && num_paths != 2) || (!compile && bench_count && num_paths != 1)) {
+        usage(argv[0]);
+        exit(5);
+    }
+
+    if (compile) {
+        return compile_module(paths[0], paths[1]);
+    }
+
+    // Notes are resampled to the output rate, as they would be for playback
+    if (bench_count) {
+        s3m_init_audio(&output_config, 1);
+        return bench_module(paths[0], bench_count);
+    }
+
+    // A port picks the serve output unless another one is named, in whichever order
+    const s3m_output_t *serve = s3m_find_output("serve");
+    if (output_config.port && !output) output = serve;
+
+    if ((output == serve || serve_test_clients) && !output_config.port) {
+        fprintf(stderr, "The serve output requires a port; use --serve PORT.\n");
+        exit(10);
     }
+
+    if (output_config.port && output != serve) {
+        fprintf(stderr, "The -s option only applies to the serve output.\n");
+        exit(10);
+    }
+
+    if (serve_test_clients) {
+        s3m_init_audio(&output_config, mix_threads);
+        return serve_test(serve_test_clients);
+    }
+
+    // A single module repeats until interrupted, a playlist plays through once
+    if (loop_count < 0) {
+        loop_count = num_paths > 1 ? 1 : 0;
+    }
+
+    if (!output) output = s3m_find_output("sdl");
+
+    // Raw audio on standard output leaves no room for the tracker display
+    if (!strcmp(output->name, "raw") && !strcmp(output_config.path, "-")) {
+        show_ui = 0;
+    }
+
+    track_t *tracks = calloc(num_paths, sizeof(track_t));
+    assert(tracks);
+
+    for (int i = 0; i < num_paths; ++i) {
+        tracks[i].path = paths[i];
+        tracks[i].previous = i > 0 ? tracks + i - 1 : NULL;
+    }
+
+    // Samples are resampled to the output rate as they load, so the mixer is set up first
+    s3m_init_audio(&output_config, mix_threads);
+    if (mix_threads > 1) {
+        fprintf(stderr, "Offline mixes are split from %u voice-frames per thread.\n",
+            s3m_audio_mix_threshold()
+        );
+    }
+
+    // The first module is opened up front so a broken file fails before the output opens
+    open_track(tracks);
+    if (!tracks[0].ok && num_paths == 1) {
+        exit(12);
+    }
+
+    if (num_paths > 1) {
+        start_prefetch(tracks + 1);
+    }
+
+    if (output->open(&output_config)) {
+        exit(11);
+    }
+
+    // Disable line wrapping
+    if (show_ui && !wrap) {
+        printf("\033[?7l");
+    }
+
+    s3m_ui_t ui;
+    if (show_ui && s3m_ui_start(&ui)) {
+        show_ui = 0;
+    }
+
+    // The first row plays as soon as the output reaches it
+    double clock = s3m_audio_position();
+
+    track_t *retired = NULL;
+    uint64_t retired_at = 0;
+
+    for (int i = 0; i < num_paths; ++i) {
+        track_t *track = tracks + i;
+
+        if (i > 0) join_prefetch(track);
+        if (i > 0 && i + 1 < num_paths) start_prefetch(track + 1);
+        if (!track->ok) continue;
+
+        // Rows of the previous module still on their way out are not drawn against this one
+        if (show_ui) s3m_ui_set_module(&ui, &track->s3m, (uint8_t) i);
+
+        play_track(track, (uint8_t) i, &clock);
+
+        // The next module starts on this very frame, so only the voices of this one are cut
+        uint64_t boundary = (uint64_t) clock;
+        s3m_audio_silence(boundary);
+
+        // By now the renderer is long past the previous boundary, so this hardly ever waits.
+        // Once past it, neither the voices nor the display refer to that module anymore.
+        if (retired) {
+            s3m_audio_drain(retired_at + 1);
+            close_track(retired);
+        }
+
+        retired = track;
+        retired_at = boundary;
+    }
+
+    s3m_audio_finish((uint64_t) clock);
+    s3m_audio_drain((uint64_t) clock);
+
+    if (show_ui) {
+        s3m_ui_stop(&ui);
+
+        if (!wrap) printf("\033[?7h");
+        printf("\n");
+    }
+
+    output->close();
+
+    for (int i = 0; i < num_paths; ++i) {
+        close_track(tracks + i);
+        free(paths[i]);
+    }
+
+    free(tracks);
+    free(paths);
+
+    return 0;
 }
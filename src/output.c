@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <SDL2/SDL.h>
+
+#include "s3m.h"
+
+static SDL_AudioDeviceID sdl_device;
+
+static void sdl_callback(void *udata, Uint8 *stream, int len) {
+    const s3m_output_config_t *config = udata;
+
+    // The device cannot wait, so whatever the player has not scheduled in time plays late
+    s3m_audio_render((int16_t *) stream, len / (sizeof(int16_t) * config->channels), 0);
+}
+
+static int sdl_open(const s3m_output_config_t *config) {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO)) {
+        fprintf(stderr, "Unable to initialize SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    SDL_AudioSpec desired = {
+        .freq = config->rate,
+        .format = AUDIO_S16SYS,
+        .channels = config->channels,
+        .samples = config->buffer_frames,
+        .callback = sdl_callback,
+        .userdata = (void *) config
+    };
+
+    // SDL converts to whatever the device wants, so the mixer always sees the requested format
+    sdl_device = SDL_OpenAudioDevice(NULL, 0, &desired, NULL, 0);
+    if (!sdl_device) {
+        fprintf(stderr, "Unable to open the audio device: %s\n", SDL_GetError());
+        return 2;
+    }
+
+    SDL_PauseAudioDevice(sdl_device, 0);
+    return 0;
+}
+
+static void sdl_close(void) {
+    SDL_CloseAudioDevice(sdl_device);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
+
+// Backends without a device of their own render from a pump thread. The renderer waits for
+// the player, so these run as fast as the consumer allows instead of in real time.
+typedef struct pump {
+    pthread_t thread;
+    atomic_int stop;
+
+    int fd;
+    int16_t *buffer;
+    unsigned frames;
+    size_t frame_size;
+} pump_t;
+
+static pump_t pump;
+
+static void write_all(size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t status = write(pump.fd, (uint8_t *) pump.buffer + written, size - written);
+        if (status == -1) {
+            if (errno == EINTR) continue;
+
+            fprintf(stderr, "Unable to write audio. %s.\n", strerror(errno));
+            exit(10);
+        }
+
+        written += status;
+    }
+}
+
+static void *pump_main(void *arg) {
+    (void) arg;
+
+    while (!atomic_load(&pump.stop)) {
+        unsigned frames = s3m_audio_render(pump.buffer, pump.frames, 1);
+
+        // A short block means the schedule has ended; the output ends along with it
+        size_t size = frames * pump.frame_size;
+        if (pump.fd >= 0) write_all(size);
+        if (frames < pump.frames) break;
+    }
+
+    return NULL;
+}
+
+static int pump_open(const s3m_output_config_t *config, int fd) {
+    pump.fd = fd;
+    pump.frames = config->buffer_frames;
+    pump.frame_size = config->channels * sizeof(int16_t);
+
+    pump.buffer = malloc(pump.frames * pump.frame_size);
+    assert(pump.buffer);
+
+    atomic_init(&pump.stop, 0);
+
+    if (pthread_create(&pump.thread, NULL, pump_main, NULL)) {
+        fprintf(stderr, "Unable to start the output thread.\n");
+        free(pump.buffer);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Must only be called once the player has finished, since the pump may be waiting for it
+static void pump_close(void) {
+    atomic_store(&pump.stop, 1);
+    pthread_join(pump.thread, NULL);
+
+    free(pump.buffer);
+    pump.buffer = NULL;
+}
+
+static int raw_open(const s3m_output_config_t *config) {
+    int fd = STDOUT_FILENO;
+
+    if (strcmp(config->path, "-")) {
+        fd = open(config->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Unable to open %s. %s.\n", config->path, strerror(errno));
+            return 1;
+        }
+    }
+
+    return pump_open(config, fd);
+}
+
+static void raw_close(void) {
+    int fd = pump.fd;
+    pump_close();
+
+    if (fd != STDOUT_FILENO) close(fd);
+}
+
+static int null_open(const s3m_output_config_t *config) {
+    return pump_open(config, -1);
+}
+
+static const s3m_output_t outputs[] = {
+    {"sdl", sdl_open, sdl_close},
+    {"raw", raw_open, raw_close},
+    {"null", null_open, pump_close},
+    {"serve", s3m_serve_open, s3m_serve_close}
+};
+
+const s3m_output_t *s3m_find_output(const char *name) {
+    for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); ++i) {
+        if (!strcmp(outputs[i].name, name)) return outputs + i;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "s3m.h"
+
+// Claims and runs tasks until none are left. Called with the pool lock held.
+static void run_tasks(s3m_pool_t *pool) {
+    while (pool->next_task < pool->num_tasks) {
+        int index = pool->next_task++;
+
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(pool->arg, index);
+        pthread_mutex_lock(&pool->lock);
+
+        if (!--pool->pending) pthread_cond_signal(&pool->done);
+    }
+}
+
+static void *pool_main(void *arg) {
+    s3m_pool_t *pool = arg;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == generation && !pool->stop) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+
+        if (pool->stop) break;
+
+        generation = pool->generation;
+        run_tasks(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int s3m_pool_start(s3m_pool_t *pool, int num_threads) {
+    assert(pool);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->task = NULL;
+    pool->arg = NULL;
+    pool->num_tasks = 0;
+    pool->next_task = 0;
+    pool->pending = 0;
+    pool->generation = 0;
+    pool->stop = 0;
+
+    pool->threads = calloc(num_threads > 0 ? num_threads : 1, sizeof(pthread_t));
+    assert(pool->threads);
+
+    pool->num_threads = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        if (pthread_create(pool->threads + i, NULL, pool_main, pool)) {
+            fprintf(stderr, "Warning: unable to start pool thread %d.\n", i);
+            break;
+        }
+
+        ++pool->num_threads;
+    }
+
+    return pool->num_threads;
+}
+
+void s3m_pool_run(s3m_pool_t *pool, s3m_pool_task_t task, void *arg, int num_tasks) {
+    pthread_mutex_lock(&pool->lock);
+
+    pool->task = task;
+    pool->arg = arg;
+    pool->num_tasks = num_tasks;
+    pool->next_task = 0;
+    pool->pending = num_tasks;
+    ++pool->generation;
+
+    pthread_cond_broadcast(&pool->start);
+
+    // The caller works along instead of idling until the workers are done
+    run_tasks(pool);
+
+    while (pool->pending) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void s3m_pool_stop(s3m_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->num_threads = 0;
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include <limits.h>
 
@@ -8,6 +9,8 @@
 
 #define MAX_SAMPLE_SIZE 64000
 
+#define ARENA_ALIGNMENT 16
+
 #define MS_TO_OFF(ms_) ((((ms_)[2] << 8) | (ms_)[1]) * 16)
 
 static char *strlcpy(char *dest, const char *src, size_t size) {
@@ -16,22 +19,23 @@ static char *strlcpy(char *dest, const char *src, size_t size) {
     return dest;
 }
 
-static s3m_vinstrument_t *create_vinstr(uint8_t *u8, s3m_instrument_t *on_disk) {
+static uint16_t get_sample_length(s3m_instrument_t *on_disk) {
+    uint16_t sample_size = on_disk->length;
+    return sample_size > MAX_SAMPLE_SIZE ? MAX_SAMPLE_SIZE : sample_size;
+}
+
+static void create_vinstr(s3m_vinstrument_t *vinstr, uint8_t *u8, s3m_instrument_t *on_disk) {
     char title[S3M_TITLE_LENGTH + 1] = {0};
     memcpy(title, on_disk->title, S3M_TITLE_LENGTH);
 
-    uint16_t sample_size = on_disk->length;
-    if (sample_size > MAX_SAMPLE_SIZE) {
+    uint16_t sample_size = get_sample_length(on_disk);
+    if (sample_size < (uint16_t) on_disk->length) {
         fprintf(stderr, "Warning: sample %s size %hu exceeds limit of %hu.\n",
-            title, sample_size, (uint16_t) MAX_SAMPLE_SIZE
+            title, (uint16_t) on_disk->length, (uint16_t) MAX_SAMPLE_SIZE
         );
-        sample_size = MAX_SAMPLE_SIZE;
     }
 
-    s3m_vinstrument_t *vinstr = malloc(sizeof(s3m_vinstrument_t) + sample_size * sizeof(float));
-    assert(vinstr);
-
-    vinstr->on_disk = on_disk;
+    vinstr->on_disk = *on_disk;
     vinstr->sample_length = sample_size;
 
     if (!(on_disk->flags & 4)) {
@@ -51,13 +55,23 @@ static s3m_vinstrument_t *create_vinstr(uint8_t *u8, s3m_instrument_t *on_disk)
     }
 
     memcpy(vinstr->title, title, S3M_TITLE_LENGTH + 1);
+}
+
+static s3m_instrument_t *get_on_disk_instrument(s3m_t *s3m, uint16_t instr) {
+    uint8_t *u8 = (uint8_t *) s3m->hdr;
+    uint16_t *u16 = (uint16_t *) s3m->hdr;
 
-    return vinstr;
+    uint32_t pp = u16[S3M_INPP_OFFSET(s3m) / 2 + instr] * 16;
+    return (s3m_instrument_t *) (u8 + pp);
 }
 
-static s3m_cell_t *read_pattern(s3m_t *s3m, uint8_t *u8) {
-    s3m_cell_t *cells = calloc(S3M_NUM_ROWS_PER_PATTERN * S3M_NUM_CHANNELS, sizeof(s3m_cell_t));
-    assert(cells);
+static uint32_t get_pattern_offset(s3m_t *s3m, uint16_t pattern) {
+    uint16_t *u16 = (uint16_t *) s3m->hdr;
+    return u16[S3M_PAPP_OFFSET(s3m) / 2 + pattern] * 16;
+}
+
+static void read_pattern(s3m_t *s3m, s3m_cell_t *cells, uint8_t *u8) {
+    memset(cells, 0, S3M_PATTERN_SIZE);
 
     uint16_t length = *((uint16_t *) u8);
 
@@ -116,8 +130,8 @@ static s3m_cell_t *read_pattern(s3m_t *s3m, uint8_t *u8) {
             cell.volume = previous_volume[channel];
         }
 
-        if (!cell.volume && cell.instrument) {
-            cell.volume = s3m->instruments[cell.instrument - 1]->on_disk->volume;
+        if (!cell.volume && cell.instrument && cell.instrument <= s3m->hdr->num_instruments) {
+            cell.volume = get_on_disk_instrument(s3m, cell.instrument - 1)->volume;
         }
 
         if (cell.raw & 128) {
@@ -129,8 +143,6 @@ static s3m_cell_t *read_pattern(s3m_t *s3m, uint8_t *u8) {
 
         *s3m_get_cell(cells, channel, row) = cell;
     }
-
-    return cells;
 }
 
 s3m_error_t s3m_open(void *buf, s3m_t *s3m) {
@@ -149,37 +161,215 @@ s3m_error_t s3m_open(void *buf, s3m_t *s3m) {
     s3m->tempo = s3m->hdr->initial_tempo;
     s3m->speed = s3m->hdr->initial_speed;
 
-    uint8_t *u8 = buf;
-    uint16_t *u16 = buf;
+    s3m->orders = (uint8_t *) buf + sizeof(s3m_header_t);
 
-    s3m->orders = u8 + sizeof(s3m_header_t);
+    s3m_read_pan(s3m);
+    s3m_alloc_arena(s3m, 1);
 
-    s3m->instruments = malloc(s3m->hdr->num_instruments * sizeof(s3m_vinstrument_t *));
-    assert(s3m->instruments);
+    return S3M_OK;
+}
 
-    for (uint16_t i = 0; i < s3m->hdr->num_instruments; ++i) {
-        uint16_t pp = u16[S3M_INPP_OFFSET(s3m) / 2 + i] * 16;
+size_t s3m_get_header_size(s3m_t *s3m) {
+    if (s3m->hdr->default_pan == S3M_DEFAULT_PAN_TABLE) {
+        return S3M_PAN_OFFSET(s3m) + S3M_NUM_CHANNELS;
+    }
+
+    return S3M_PAN_OFFSET(s3m);
+}
+
+static uint8_t get_pan(s3m_t *s3m, int channel) {
+    uint8_t setting = s3m->hdr->channel_settings[channel] & ~S3M_CHANNEL_DISABLED;
+    uint8_t pan = setting > S3M_CHANNEL_LAST_LEFT ? S3M_PAN_RIGHT : S3M_PAN_LEFT;
+
+    if (s3m->hdr->default_pan == S3M_DEFAULT_PAN_TABLE) {
+        uint8_t entry = ((uint8_t *) s3m->hdr)[S3M_PAN_OFFSET(s3m) + channel];
+        if (entry & S3M_PAN_SET) pan = entry & 0xF;
+    }
+
+    return pan;
+}
+
+void s3m_read_pan(s3m_t *s3m) {
+    int stereo = s3m->hdr->master_volume & S3M_MASTER_STEREO;
+
+    for (int c = 0; c < S3M_NUM_CHANNELS; ++c) {
+        uint8_t setting = s3m->hdr->channel_settings[c] & ~S3M_CHANNEL_DISABLED;
 
-        s3m_instrument_t *on_disk = (s3m_instrument_t *) (u8 + pp);
-        s3m->instruments[i] = create_vinstr(u8, on_disk);
+        // Mono modules and channels past the sixteen PCM ones have no side of their own
+        s3m->pan[c] = S3M_PAN_MONO;
+        if (stereo && setting <= S3M_CHANNEL_LAST_RIGHT) {
+            s3m->pan[c] = get_pan(s3m, c);
+        }
     }
+}
+
+static void *arena_take(s3m_t *s3m, size_t *used, size_t size) {
+    void *ptr = s3m->arena ? (uint8_t *) s3m->arena + *used : NULL;
+    *used += S3M_ALIGN(size, ARENA_ALIGNMENT);
+    return ptr;
+}
+
+// Hands out every table and, if decoding, a slot for every instrument and pattern.
+// Without an arena it only adds up the sizes.
+static size_t layout_arena(s3m_t *s3m, int decode) {
+    uint16_t num_instruments = s3m->hdr->num_instruments;
+    uint16_t num_patterns = s3m->hdr->num_patterns;
+
+    size_t used = 0;
+
+    s3m->instruments = arena_take(s3m, &used, num_instruments * sizeof(s3m_vinstrument_t *));
+    s3m->instrument_loaded = arena_take(s3m, &used, num_instruments * sizeof(atomic_uchar));
+    s3m->patterns = arena_take(s3m, &used, num_patterns * sizeof(s3m_cell_t *));
+    s3m->pattern_loaded = arena_take(s3m, &used, num_patterns * sizeof(atomic_uchar));
+    s3m->resample_cache = arena_take(s3m, &used,
+        num_instruments * S3M_NUM_NOTES * sizeof(*s3m->resample_cache)
+    );
+
+    if (!decode) return used;
+
+    for (uint16_t i = 0; i < num_instruments; ++i) {
+        uint16_t length = get_sample_length(get_on_disk_instrument(s3m, i));
+        void *slot = arena_take(s3m, &used, offsetof(s3m_vinstrument_t, sample) + length * sizeof(float));
+
+        if (s3m->arena) s3m->instruments[i] = slot;
+    }
+
+    for (uint16_t i = 0; i < num_patterns; ++i) {
+        if (!get_pattern_offset(s3m, i)) continue;
+
+        void *slot = arena_take(s3m, &used, S3M_PATTERN_SIZE);
+        if (s3m->arena) s3m->patterns[i] = slot;
+    }
+
+    return used;
+}
+
+void s3m_alloc_arena(s3m_t *s3m, int decode) {
+    s3m->arena = NULL;
+    size_t size = layout_arena(s3m, decode);
+
+    // Pages of the arena are only touched once the loader decodes into them
+    s3m->arena = calloc(1, size ? size : 1);
+    assert(s3m->arena);
+    layout_arena(s3m, decode);
 
-    s3m->patterns = malloc(s3m->hdr->num_patterns * sizeof(s3m_cell_t *));
-    assert(s3m->patterns);
+    for (uint16_t i = 0; i < s3m->hdr->num_instruments; ++i) {
+        atomic_init(&s3m->instrument_loaded[i], 0);
+
+        for (int k = 0; k < S3M_NUM_NOTES; ++k) {
+            atomic_init(&s3m->resample_cache[i * S3M_NUM_NOTES + k], NULL);
+        }
+    }
 
     for (uint16_t i = 0; i < s3m->hdr->num_patterns; ++i) {
-        uint16_t pp = u16[S3M_PAPP_OFFSET(s3m) / 2 + i] * 16;
+        atomic_init(&s3m->pattern_loaded[i], 0);
+    }
 
-        if (!pp) {
-            s3m->patterns[i] = NULL;
-            continue;
+    pthread_mutex_init(&s3m->load_lock, NULL);
+
+    pthread_mutex_init(&s3m->resample_lock, NULL);
+    s3m->resample_chunks = NULL;
+}
+
+// Called with resample_lock held. Notes larger than a chunk get one of their own, behind
+// the current one, so the space left in the current one is not given up.
+void *s3m_alloc_resampled(s3m_t *s3m, size_t size) {
+    size = S3M_ALIGN(size, ARENA_ALIGNMENT);
+
+    s3m_chunk_t *chunk = s3m->resample_chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > S3M_RESAMPLE_CHUNK_SIZE ? size : S3M_RESAMPLE_CHUNK_SIZE;
+
+        chunk = malloc(sizeof(s3m_chunk_t) + chunk_size);
+        assert(chunk);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+
+        if (s3m->resample_chunks && size > S3M_RESAMPLE_CHUNK_SIZE) {
+            chunk->next = s3m->resample_chunks->next;
+            s3m->resample_chunks->next = chunk;
+        } else {
+            chunk->next = s3m->resample_chunks;
+            s3m->resample_chunks = chunk;
         }
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
 
-        s3m_cell_t *cells = read_pattern(s3m, u8 + pp);
-        s3m->patterns[i] = cells;
+void s3m_close(s3m_t *s3m) {
+    while (s3m->resample_chunks) {
+        s3m_chunk_t *chunk = s3m->resample_chunks;
+        s3m->resample_chunks = chunk->next;
+        free(chunk);
     }
 
-    return S3M_OK;
+    pthread_mutex_destroy(&s3m->resample_lock);
+    pthread_mutex_destroy(&s3m->load_lock);
+
+    free(s3m->arena);
+    s3m->arena = NULL;
+}
+
+s3m_vinstrument_t *s3m_load_instrument(s3m_t *s3m, uint16_t instr) {
+    if (instr >= s3m->hdr->num_instruments) return NULL;
+
+    if (atomic_load_explicit(&s3m->instrument_loaded[instr], memory_order_acquire)) {
+        return s3m->instruments[instr];
+    }
+
+    pthread_mutex_lock(&s3m->load_lock);
+    if (!atomic_load_explicit(&s3m->instrument_loaded[instr], memory_order_relaxed)) {
+        create_vinstr(s3m->instruments[instr], (uint8_t *) s3m->hdr, get_on_disk_instrument(s3m, instr));
+        atomic_store_explicit(&s3m->instrument_loaded[instr], 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&s3m->load_lock);
+
+    return s3m->instruments[instr];
+}
+
+s3m_cell_t *s3m_load_pattern(s3m_t *s3m, uint16_t pattern) {
+    if (pattern >= s3m->hdr->num_patterns) return NULL;
+
+    if (atomic_load_explicit(&s3m->pattern_loaded[pattern], memory_order_acquire)) {
+        return s3m->patterns[pattern];
+    }
+
+    pthread_mutex_lock(&s3m->load_lock);
+    if (!atomic_load_explicit(&s3m->pattern_loaded[pattern], memory_order_relaxed)) {
+        uint32_t pp = get_pattern_offset(s3m, pattern);
+        if (pp) {
+            read_pattern(s3m, s3m->patterns[pattern], (uint8_t *) s3m->hdr + pp);
+        }
+
+        atomic_store_explicit(&s3m->pattern_loaded[pattern], 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&s3m->load_lock);
+
+    return s3m->patterns[pattern];
+}
+
+const char *s3m_strerror(s3m_error_t error) {
+    switch (error) {
+        case S3M_OK:
+            return "Success";
+
+        case S3M_E_BAD_HEADER_MAGIC:
+            return "Not a ScreamTracker 3 module";
+
+        case S3M_E_BAD_IMAGE_MAGIC:
+            return "Not a compiled module";
+
+        case S3M_E_BAD_IMAGE_VERSION:
+            return "Compiled by an incompatible version or on an incompatible machine";
+
+        case S3M_E_BAD_IMAGE:
+            return "Compiled module is truncated or corrupt";
+    }
+
+    return "Unknown error";
 }
 
 static const char *note_names[] = {
@@ -264,7 +454,7 @@ void s3m_cell_to_text(s3m_cell_t *cell, char *buf, size_t len) {
 
 double s3m_get_note_freq(s3m_vinstrument_t *vinstr, uint8_t note) {
     double period = 8368.0 * 16 * (note_periods[note & 0xF] >> (note >> 4)) 
-                  / vinstr->on_disk->c5_freq;
+                  / vinstr->on_disk.c5_freq;
 
     return 14317056.0 / period;
 }
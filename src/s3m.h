@@ -1,8 +1,12 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <assert.h>
 
+#include <pthread.h>
+
 #define S3M_TITLE_LENGTH 28
 #define S3M_FILENAME_LENGTH 12
 
@@ -13,12 +17,66 @@
 
 #define S3M_INSTRUMENT_MAGIC "SCRS"
 
+#define S3M_IMAGE_MAGIC "S3MC"
+#define S3M_IMAGE_VERSION 2
+#define S3M_IMAGE_BYTE_ORDER 0x01020304
+#define S3M_IMAGE_ALIGNMENT 16
+
 #define S3M_NUM_CHANNELS 32
 #define S3M_NUM_ROWS_PER_PATTERN 64
+#define S3M_NUM_NOTES 128
+
+// Mixing threads, the rendering thread included
+#define S3M_MAX_MIX_THREADS 8
+
+#define S3M_PATTERN_SIZE (S3M_NUM_ROWS_PER_PATTERN * S3M_NUM_CHANNELS * sizeof(s3m_cell_t))
+
+// About 700 ms of served audio with the default buffer; a client further behind skips ahead
+#define S3M_SERVE_RING_BLOCKS 32
+
+// A served client that takes nothing for this long is dropped
+#define S3M_SERVE_STALL_SECONDS 5
+
+// Resampled notes are carved from chunks of at least this size
+#define S3M_RESAMPLE_CHUNK_SIZE (1 << 20)
+
+// Rounds a size up to a multiple of a power of two alignment
+#define S3M_ALIGN(size_, alignment_) (((size_) + (alignment_) - 1) & ~((uint64_t) (alignment_) - 1))
 
 #define S3M_SEG_TO_OFF(seg_) ((seg_) * 16)
 #define S3M_INPP_OFFSET(s3m_) (sizeof(s3m_header_t) + (s3m_)->hdr->num_orders)
 #define S3M_PAPP_OFFSET(s3m_) (S3M_INPP_OFFSET(s3m_) + (s3m_)->hdr->num_instruments * 2)
+#define S3M_PAN_OFFSET(s3m_) (S3M_PAPP_OFFSET(s3m_) + (s3m_)->hdr->num_patterns * 2)
+
+// Bit 7 of the master volume marks a stereo module
+#define S3M_MASTER_STEREO 0x80
+
+// A default pan of 252 means a pan table follows the parapointers
+#define S3M_DEFAULT_PAN_TABLE 252
+#define S3M_PAN_SET 0x20
+#define S3M_PAN_LEFT 0x3
+#define S3M_PAN_RIGHT 0xC
+
+#define S3M_CHANNEL_DISABLED 0x80
+#define S3M_CHANNEL_LAST_LEFT 7
+#define S3M_CHANNEL_LAST_RIGHT 15
+
+// Pans run from 0, hard left, to 15, hard right. Channels of mono modules play the same
+// on both sides instead.
+#define S3M_PAN_MAX 15
+#define S3M_PAN_MONO 16
+
+#define S3M_ORDER_SKIP 254
+#define S3M_ORDER_END 255
+
+// The tag tells apart positions of consecutive modules in a playlist
+#define S3M_POSITION(tag_, order_, pattern_, row_) \
+    (((uint32_t) (uint8_t) (tag_) << 24) | ((uint32_t) (uint8_t) (order_) << 16) \
+    | ((uint32_t) (uint8_t) (pattern_) << 8) | (uint32_t) (uint8_t) (row_))
+#define S3M_POSITION_TAG(pos_) ((uint8_t) ((pos_) >> 24))
+#define S3M_POSITION_ORDER(pos_) ((uint8_t) ((pos_) >> 16))
+#define S3M_POSITION_PATTERN(pos_) ((uint8_t) ((pos_) >> 8))
+#define S3M_POSITION_ROW(pos_) ((uint8_t) (pos_))
 
 #define S3M_IS_EFFECT(val_, eff_) ((val_) == (eff_) - 'A' + 1)
 
@@ -46,7 +104,9 @@ typedef struct s3m_header {
     uint8_t initial_tempo;
     uint8_t master_volume;
 
-    uint8_t unused2[10];
+    uint8_t ultra_click;
+    uint8_t default_pan;
+    uint8_t unused2[8];
 
     uint16_t special;
 
@@ -90,15 +150,43 @@ typedef struct s3m_cell {
     uint8_t effect_info;
 } s3m_cell_t;
 
+// Holds no pointers, so that compiled images can store these records verbatim
 typedef struct s3m_vinstrument {
-    s3m_instrument_t *on_disk;
+    s3m_instrument_t on_disk;
 
     char title[S3M_TITLE_LENGTH + 1];
 
-    size_t sample_length;
+    uint32_t sample_length;
     float sample[];
 } s3m_vinstrument_t;
 
+// A compiled module. All references are offsets from the start of the image.
+typedef struct s3m_image_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t vinstrument_size;
+
+    uint64_t size;
+
+    // The original header, order list, parapointers and pan table, copied verbatim
+    uint64_t header_offset;
+    uint64_t header_size;
+
+    // Tables of uint64_t offsets to s3m_vinstrument_t records and pattern grids.
+    // Empty patterns have offset 0.
+    uint64_t instruments_offset;
+    uint64_t patterns_offset;
+} s3m_image_header_t;
+
+typedef struct s3m_chunk {
+    struct s3m_chunk *next;
+    size_t size;
+    size_t used;
+
+    _Alignas(16) uint8_t data[];
+} s3m_chunk_t;
+
 typedef struct s3m {
     s3m_header_t *hdr;
 
@@ -108,12 +196,96 @@ typedef struct s3m {
 
     double tempo;
     double speed;
+
+    // Pan of every channel, from the channel settings and the pan table
+    uint8_t pan[S3M_NUM_CHANNELS];
+
+    // Instruments and patterns are decoded on first use; see s3m_load_instrument
+    pthread_mutex_t load_lock;
+    atomic_uchar *instrument_loaded;
+    atomic_uchar *pattern_loaded;
+
+    // Notes resampled to the output rate, by instrument * S3M_NUM_NOTES + note. Their
+    // sizes depend on the output rate, so they live in chunks of their own, guarded by
+    // resample_lock and freed together on close.
+    int16_t *_Atomic *resample_cache;
+    pthread_mutex_t resample_lock;
+    s3m_chunk_t *resample_chunks;
+
+    // Every table and decoded instrument and pattern above lives in this single allocation
+    void *arena;
 } s3m_t;
 
+typedef struct s3m_loader {
+    s3m_t *s3m;
+
+    atomic_uint next_order;
+
+    // Set once every order has been handed out, though the last ones may still be in work
+    pthread_mutex_t lock;
+    pthread_cond_t claimed_cond;
+    int claimed;
+
+    int num_threads;
+    pthread_t *threads;
+} s3m_loader_t;
+
+typedef struct s3m_ui {
+    // The module on display and its position tag, guarded by lock
+    pthread_mutex_t lock;
+    s3m_t *s3m;
+    uint8_t tag;
+
+    pthread_t thread;
+    atomic_int stop;
+} s3m_ui_t;
+
+typedef void (*s3m_pool_task_t)(void *arg, int index);
+
+typedef struct s3m_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    s3m_pool_task_t task;
+    void *arg;
+    int num_tasks;
+    int next_task;
+    int pending;
+    unsigned generation;
+    int stop;
+
+    int num_threads;
+    pthread_t *threads;
+} s3m_pool_t;
+
+typedef struct s3m_output_config {
+    int rate;
+    int buffer_frames;
+    int channels;
+
+    // Destination of the raw backend, - for standard output
+    const char *path;
+
+    // TCP port of the serve backend
+    int port;
+} s3m_output_config_t;
+
+typedef struct s3m_output {
+    const char *name;
+
+    int (*open)(const s3m_output_config_t *config);
+    void (*close)(void);
+} s3m_output_t;
+
 typedef enum s3m_error {
     S3M_OK,
 
-    S3M_E_BAD_HEADER_MAGIC
+    S3M_E_BAD_HEADER_MAGIC,
+
+    S3M_E_BAD_IMAGE_MAGIC,
+    S3M_E_BAD_IMAGE_VERSION,
+    S3M_E_BAD_IMAGE
 } s3m_error_t;
 
 typedef uint16_t s3m_parapointer_t;
@@ -124,10 +296,54 @@ static inline void s3m_assert_static_invariants(void) {
     assert(sizeof(s3m_instrument_t) == 80);
 }
 
-int s3m_init_audio(void);
-void s3m_play_sample(int channel, s3m_t *s3m, uint8_t instr, uint8_t note, uint8_t volume);
+int s3m_init_audio(const s3m_output_config_t *config, int mix_threads);
+unsigned s3m_audio_render(int16_t *out, unsigned frames, int wait);
+uint64_t s3m_audio_position(void);
+void s3m_audio_wait(uint64_t frame);
+void s3m_audio_advance(uint64_t frame);
+void s3m_audio_drain(uint64_t frame);
+void s3m_audio_finish(uint64_t end);
+void s3m_audio_silence(uint64_t frame);
+void s3m_audio_mark(uint64_t frame, uint32_t position);
+uint64_t s3m_audio_now_playing(void);
+unsigned s3m_audio_mix_threshold(void);
+void s3m_play_sample(uint64_t frame, int channel, s3m_t *s3m, uint8_t instr, uint8_t note,
+        uint8_t volume);
+void s3m_prepare_sample(s3m_t *s3m, uint8_t instr, uint8_t note);
+void s3m_play_pcm(uint64_t frame, int channel, const int16_t *pcm, unsigned length,
+        uint8_t volume);
 
 s3m_error_t s3m_open(void *buf, s3m_t *s3m);
+void s3m_alloc_arena(s3m_t *s3m, int decode);
+size_t s3m_get_header_size(s3m_t *s3m);
+void s3m_read_pan(s3m_t *s3m);
+void s3m_close(s3m_t *s3m);
+void *s3m_alloc_resampled(s3m_t *s3m, size_t size);
+s3m_vinstrument_t *s3m_load_instrument(s3m_t *s3m, uint16_t instr);
+s3m_cell_t *s3m_load_pattern(s3m_t *s3m, uint16_t pattern);
+const char *s3m_strerror(s3m_error_t error);
+
+int s3m_is_image(const void *buf, size_t size);
+s3m_error_t s3m_open_image(void *buf, size_t size, s3m_t *s3m);
+int s3m_write_image(s3m_t *s3m, FILE *out);
+
+void s3m_prepare_pattern(s3m_t *s3m, uint16_t i);
+void s3m_loader_start(s3m_loader_t *loader, s3m_t *s3m, int num_threads);
+void s3m_loader_wait_claimed(s3m_loader_t *loader);
+void s3m_loader_join(s3m_loader_t *loader);
+
+int s3m_pool_start(s3m_pool_t *pool, int num_threads);
+void s3m_pool_run(s3m_pool_t *pool, s3m_pool_task_t task, void *arg, int num_tasks);
+void s3m_pool_stop(s3m_pool_t *pool);
+
+const s3m_output_t *s3m_find_output(const char *name);
+
+int s3m_serve_open(const s3m_output_config_t *config);
+void s3m_serve_close(void);
+
+int s3m_ui_start(s3m_ui_t *ui);
+void s3m_ui_set_module(s3m_ui_t *ui, s3m_t *s3m, uint8_t tag);
+void s3m_ui_stop(s3m_ui_t *ui);
 
 void s3m_cell_to_text(s3m_cell_t *cell, char *buf, size_t len);
 
@@ -140,3 +356,7 @@ double s3m_get_note_freq(s3m_vinstrument_t *vinstr, uint8_t note);
 static inline long s3m_tempo_to_ns(s3m_t *s3m) {
     return (long) (1e9 / (4.0 * s3m->tempo * (6.0 / s3m->speed) / 60.0));
 }
+
+static inline double s3m_tempo_to_frames(s3m_t *s3m, int rate) {
+    return s3m_tempo_to_ns(s3m) * (rate / 1e9);
+}
@@ -0,0 +1,547 @@
+// For accept4
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "s3m.h"
+
+#define SERVE_MAX_IOV 16
+#define SERVE_MAX_EVENTS 64
+#define SERVE_BACKLOG 64
+
+// Each socket buffers only a few blocks, so that a client's lag shows in the ring, where it
+// is skipped ahead, instead of piling up in the kernel
+#define SERVE_SEND_BLOCKS 4
+
+// Rendered once and shared by every client. The ring holds one reference, and so does
+// each client that has sent part of the block.
+typedef struct block {
+    int refs;
+
+    // The next free block, or the next rendered one on its way to the ring
+    struct block *next;
+
+    uint8_t data[];
+} block_t;
+
+typedef struct client {
+    int fd;
+    int dead;
+    int waiting;
+
+    // The next block to send from the ring, after the rest of a partly sent one
+    uint64_t seq;
+    block_t *partial;
+    size_t offset;
+
+    uint64_t last_progress;
+} client_t;
+
+// Blocks are rendered on their own thread and handed to the network thread, which owns
+// the ring and the clients. Only the free and rendered lists are shared, under lock.
+typedef struct server {
+    pthread_t thread;
+    pthread_t render_thread;
+
+    int epoll_fd;
+    int listen_fd;
+    int timer_fd;
+    int stop_fd;
+    int render_fd;
+
+    unsigned frames;
+    size_t block_size;
+    uint64_t stall_blocks;
+
+    block_t *ring[S3M_SERVE_RING_BLOCKS];
+    uint64_t next_seq;
+
+    pthread_mutex_t lock;
+    block_t *free_blocks;
+    block_t *rendered;
+    block_t *rendered_tail;
+
+    client_t **clients;
+    int num_clients;
+    int max_clients;
+} server_t;
+
+static server_t server;
+
+// Markers for the descriptors that are not clients
+static int listen_tag, render_tag, stop_tag;
+
+static block_t *take_block(void) {
+    pthread_mutex_lock(&server.lock);
+    block_t *block = server.free_blocks;
+    if (block) server.free_blocks = block->next;
+    pthread_mutex_unlock(&server.lock);
+
+    if (!block) {
+        block = malloc(sizeof(block_t) + server.block_size);
+        assert(block);
+    }
+
+    block->refs = 1;
+    block->next = NULL;
+    return block;
+}
+
+static void release_block(block_t *block) {
+    if (!block || --block->refs) return;
+
+    pthread_mutex_lock(&server.lock);
+    block->next = server.free_blocks;
+    server.free_blocks = block;
+    pthread_mutex_unlock(&server.lock);
+}
+
+static void free_blocks(block_t *block) {
+    while (block) {
+        block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+static void watch_client(client_t *client, int waiting) {
+    if (client->waiting == waiting) return;
+
+    struct epoll_event event = {.events = EPOLLIN | (waiting ? EPOLLOUT : 0), .data.ptr = client};
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    client->waiting = waiting;
+}
+
+// Closes the connection right away; the client itself is freed after the current batch
+// of events, which may still refer to it.
+static void drop_client(client_t *client) {
+    if (client->dead) return;
+
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+
+    release_block(client->partial);
+    client->partial = NULL;
+    client->dead = 1;
+}
+
+static void reap_clients(void) {
+    int kept = 0;
+    for (int i = 0; i < server.num_clients; ++i) {
+        if (server.clients[i]->dead) {
+            free(server.clients[i]);
+        } else {
+            server.clients[kept++] = server.clients[i];
+        }
+    }
+
+    server.num_clients = kept;
+}
+
+static void flush_client(client_t *client) {
+    if (client->dead) return;
+
+    // A lagging client skips ahead to the newest block, but finishes a partly sent one
+    // first so its stream stays aligned to whole frames
+    uint64_t oldest = server.next_seq > S3M_SERVE_RING_BLOCKS
+        ? server.next_seq - S3M_SERVE_RING_BLOCKS : 0;
+    if (client->seq < oldest) client->seq = server.next_seq - 1;
+
+    struct iovec iov[SERVE_MAX_IOV];
+    int count = 0;
+
+    if (client->partial) {
+        iov[count].iov_base = client->partial->data + client->offset;
+        iov[count].iov_len = server.block_size - client->offset;
+        ++count;
+    }
+
+    for (uint64_t seq = client->seq; seq < server.next_seq && count < SERVE_MAX_IOV; ++seq) {
+        iov[count].iov_base = server.ring[seq % S3M_SERVE_RING_BLOCKS]->data;
+        iov[count].iov_len = server.block_size;
+        ++count;
+    }
+
+    if (!count) {
+        watch_client(client, 0);
+        return;
+    }
+
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+    ssize_t sent = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            watch_client(client, 1);
+        } else {
+            drop_client(client);
+        }
+        return;
+    }
+
+    size_t left = sent;
+    if (client->partial) {
+        size_t rest = server.block_size - client->offset;
+        if (left < rest) {
+            client->offset += left;
+            left = 0;
+        } else {
+            left -= rest;
+            release_block(client->partial);
+            client->partial = NULL;
+        }
+    }
+
+    while (left >= server.block_size) {
+        left -= server.block_size;
+        ++client->seq;
+    }
+
+    if (left) {
+        client->partial = server.ring[client->seq % S3M_SERVE_RING_BLOCKS];
+        ++client->partial->refs;
+        client->offset = left;
+        ++client->seq;
+    }
+
+    if (sent) client->last_progress = server.next_seq;
+
+    // Whatever the socket did not take is sent once it has room again
+    watch_client(client, client->partial || client->seq < server.next_seq);
+}
+
+static void accept_clients(void) {
+    for (;;) {
+        int fd = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Warning: unable to accept a client. %s.\n", strerror(errno));
+            }
+            return;
+        }
+
+        int send_buffer = (int) (SERVE_SEND_BLOCKS * server.block_size);
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+
+        client_t *client = calloc(1, sizeof(client_t));
+        assert(client);
+
+        // New clients join live, at the next block to be rendered
+        client->fd = fd;
+        client->seq = server.next_seq;
+        client->last_progress = server.next_seq;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            close(fd);
+            free(client);
+            continue;
+        }
+
+        if (server.num_clients == server.max_clients) {
+            server.max_clients = server.max_clients ? server.max_clients * 2 : 16;
+            server.clients = realloc(server.clients, server.max_clients * sizeof(client_t *));
+            assert(server.clients);
+        }
+
+        server.clients[server.num_clients++] = client;
+    }
+}
+
+static void read_client(client_t *client) {
+    if (client->dead) return;
+
+    // Clients have nothing to say; anything they send is discarded until they hang up
+    uint8_t buffer[512];
+    for (;;) {
+        ssize_t status = read(client->fd, buffer, sizeof(buffer));
+        if (status > 0) continue;
+        if (status == -1 && errno == EINTR) continue;
+
+        if (!status || (errno != EAGAIN && errno != EWOULDBLOCK)) drop_client(client);
+        return;
+    }
+}
+
+// Blocks are rendered in real time, whether or not anyone is listening, so a slow mix
+// never holds up sending and busy sockets never hold up the mix
+static void *render_main(void *arg) {
+    (void) arg;
+
+    struct pollfd fds[] = {
+        {.fd = server.timer_fd, .events = POLLIN},
+        {.fd = server.stop_fd, .events = POLLIN}
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+
+            fprintf(stderr, "Unable to wait for the server clock. %s.\n", strerror(errno));
+            exit(17);
+        }
+
+        if (fds[1].revents) break;
+
+        uint64_t expirations = 0;
+        if (read(server.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            continue;
+        }
+
+        // After a stall, only as much as the ring holds is caught up on
+        if (expirations > S3M_SERVE_RING_BLOCKS) expirations = S3M_SERVE_RING_BLOCKS;
+        while (expirations--) {
+            block_t *block = take_block();
+            s3m_audio_render((int16_t *) block->data, server.frames, 0);
+
+            pthread_mutex_lock(&server.lock);
+            if (server.rendered) {
+                server.rendered_tail->next = block;
+            } else {
+                server.rendered = block;
+            }
+            server.rendered_tail = block;
+            pthread_mutex_unlock(&server.lock);
+        }
+
+        uint64_t one = 1;
+        if (write(server.render_fd, &one, sizeof(one)) != sizeof(one)) {
+            fprintf(stderr, "Warning: unable to wake the server thread.\n");
+        }
+    }
+
+    return NULL;
+}
+
+static void on_rendered(void) {
+    uint64_t count;
+    if (read(server.render_fd, &count, sizeof(count)) != sizeof(count)) return;
+
+    pthread_mutex_lock(&server.lock);
+    block_t *block = server.rendered;
+    server.rendered = NULL;
+    server.rendered_tail = NULL;
+    pthread_mutex_unlock(&server.lock);
+
+    while (block) {
+        block_t *next = block->next;
+        block->next = NULL;
+
+        block_t **slot = server.ring + server.next_seq % S3M_SERVE_RING_BLOCKS;
+        release_block(*slot);
+        *slot = block;
+
+        ++server.next_seq;
+        block = next;
+    }
+
+    // Clients waiting for room are sent to when they have it; the rest get the new block now
+    for (int i = 0; i < server.num_clients; ++i) {
+        client_t *client = server.clients[i];
+
+        if (server.next_seq - client->last_progress > server.stall_blocks) {
+            drop_client(client);
+        } else if (!client->waiting) {
+            flush_client(client);
+        }
+    }
+}
+
+static void *serve_main(void *arg) {
+    (void) arg;
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    int running = 1;
+
+    while (running) {
+        int count = epoll_wait(server.epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+
+            fprintf(stderr, "Unable to wait for clients. %s.\n", strerror(errno));
+            exit(17);
+        }
+
+        for (int i = 0; i < count; ++i) {
+            void *tag = events[i].data.ptr;
+
+            if (tag == &stop_tag) {
+                running = 0;
+            } else if (tag == &render_tag) {
+                on_rendered();
+            } else if (tag == &listen_tag) {
+                accept_clients();
+            } else {
+                client_t *client = tag;
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    drop_client(client);
+                    continue;
+                }
+
+                if (events[i].events & EPOLLIN) read_client(client);
+                if (events[i].events & EPOLLOUT) flush_client(client);
+            }
+        }
+
+        reap_clients();
+    }
+
+    return NULL;
+}
+
+static int add_fd(int fd, void *tag) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = tag};
+    return epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static int open_listener(int port) {
+    // Listens on IPv4 and IPv6 alike where IPv6 is available, on IPv4 only otherwise
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int ipv6 = fd != -1;
+    if (!ipv6) fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create a socket. %s.\n", strerror(errno));
+        return -1;
+    }
+
+    int on = 1;
+    int off = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in6 address6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(port),
+        .sin6_addr = IN6ADDR_ANY_INIT
+    };
+    struct sockaddr_in address4 = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+
+    int status;
+    if (ipv6) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        status = bind(fd, (struct sockaddr *) &address6, sizeof(address6));
+    } else {
+        status = bind(fd, (struct sockaddr *) &address4, sizeof(address4));
+    }
+
+    if (status || listen(fd, SERVE_BACKLOG)) {
+        fprintf(stderr, "Unable to listen on port %d. %s.\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void close_fds(void) {
+    if (server.listen_fd >= 0) close(server.listen_fd);
+    if (server.timer_fd >= 0) close(server.timer_fd);
+    if (server.stop_fd >= 0) close(server.stop_fd);
+    if (server.render_fd >= 0) close(server.render_fd);
+    if (server.epoll_fd >= 0) close(server.epoll_fd);
+}
+
+// The stop event is never read, so it wakes both threads and keeps them awake
+static void stop_threads(int rendering) {
+    uint64_t one = 1;
+    if (write(server.stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Warning: unable to stop the server threads.\n");
+    }
+
+    pthread_join(server.thread, NULL);
+    if (rendering) pthread_join(server.render_thread, NULL);
+}
+
+int s3m_serve_open(const s3m_output_config_t *config) {
+    if (!config->port) {
+        fprintf(stderr, "The serve output requires a port; use --serve PORT.\n");
+        return 1;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.frames = config->buffer_frames;
+    server.block_size = server.frames * config->channels * sizeof(int16_t);
+    server.stall_blocks = (uint64_t) S3M_SERVE_STALL_SECONDS * config->rate / server.frames;
+
+    server.listen_fd = open_listener(config->port);
+    server.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    server.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.render_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (server.listen_fd < 0 || server.timer_fd < 0 || server.stop_fd < 0 || server.render_fd < 0
+            || server.epoll_fd < 0 || add_fd(server.listen_fd, &listen_tag)
+            || add_fd(server.render_fd, &render_tag) || add_fd(server.stop_fd, &stop_tag)) {
+        if (server.listen_fd >= 0) {
+            fprintf(stderr, "Unable to set up the server. %s.\n", strerror(errno));
+        }
+        close_fds();
+        return 1;
+    }
+
+    long block_ns = (long) (server.frames * 1000000000LL / config->rate);
+    struct itimerspec interval = {
+        .it_interval = {block_ns / 1000000000L, block_ns % 1000000000L},
+        .it_value = {block_ns / 1000000000L, block_ns % 1000000000L}
+    };
+    if (timerfd_settime(server.timer_fd, 0, &interval, NULL)) {
+        fprintf(stderr, "Unable to start the server clock. %s.\n", strerror(errno));
+        close_fds();
+        return 1;
+    }
+
+    pthread_mutex_init(&server.lock, NULL);
+
+    if (pthread_create(&server.thread, NULL, serve_main, NULL)) {
+        fprintf(stderr, "Unable to start the server thread.\n");
+        pthread_mutex_destroy(&server.lock);
+        close_fds();
+        return 1;
+    }
+
+    if (pthread_create(&server.render_thread, NULL, render_main, NULL)) {
+        fprintf(stderr, "Unable to start the render thread.\n");
+        stop_threads(0);
+        pthread_mutex_destroy(&server.lock);
+        close_fds();
+        return 1;
+    }
+
+    fprintf(stderr, "Serving on port %d.\n", config->port);
+    return 0;
+}
+
+void s3m_serve_close(void) {
+    stop_threads(1);
+
+    for (int i = 0; i < server.num_clients; ++i) drop_client(server.clients[i]);
+    reap_clients();
+    free(server.clients);
+
+    for (int i = 0; i < S3M_SERVE_RING_BLOCKS; ++i) release_block(server.ring[i]);
+    free_blocks(server.free_blocks);
+    free_blocks(server.rendered);
+
+    pthread_mutex_destroy(&server.lock);
+    close_fds();
+}
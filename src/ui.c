@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+
+#include "s3m.h"
+
+#define UI_FRAME_RATE 50
+#define UI_FRAME_NS (1000000000L / UI_FRAME_RATE)
+
+#define UI_ROW_TEXT_SIZE 4096
+
+// Formats a row of the module on display. Called with the display lock held.
+static int format_row(s3m_ui_t *ui, uint32_t position, char *text, size_t text_size) {
+    if (!ui->s3m || S3M_POSITION_TAG(position) != ui->tag) return 0;
+
+    uint8_t pattern_index = S3M_POSITION_PATTERN(position);
+    uint8_t row = S3M_POSITION_ROW(position);
+
+    s3m_cell_t *pattern = s3m_load_pattern(ui->s3m, pattern_index);
+    if (!pattern) return 0;
+
+    size_t length = snprintf(text, text_size, "\n\033[3%c;1m%2d.%2d\033[0m",
+        '1' + (pattern_index % 6), pattern_index, row
+    );
+
+    for (int c = 0; c < S3M_NUM_CHANNELS && length < text_size; ++c) {
+        size_t cell_text_size = 128;
+        char cell_text[cell_text_size];
+        s3m_cell_to_text(s3m_get_cell(pattern, c, row), cell_text, cell_text_size);
+
+        length += snprintf(text + length, text_size - length, " | %s", cell_text);
+    }
+
+    return 1;
+}
+
+static void draw_row(s3m_ui_t *ui, uint32_t position) {
+    char text[UI_ROW_TEXT_SIZE];
+
+    // The terminal may block, so only the formatting happens under the lock
+    pthread_mutex_lock(&ui->lock);
+    int formatted = format_row(ui, position, text, sizeof(text));
+    pthread_mutex_unlock(&ui->lock);
+
+    if (!formatted) return;
+
+    fputs(text, stdout);
+    fflush(stdout);
+}
+
+static void *ui_main(void *arg) {
+    s3m_ui_t *ui = arg;
+
+    uint64_t drawn = 0;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!atomic_load(&ui->stop)) {
+        // Rows that went by since the last frame are skipped; only the audible one is drawn
+        uint64_t now_playing = s3m_audio_now_playing();
+        if (now_playing >> 32 != drawn >> 32) {
+            draw_row(ui, (uint32_t) now_playing);
+            drawn = now_playing;
+        }
+
+        next.tv_nsec += UI_FRAME_NS;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            ++next.tv_sec;
+        }
+
+        // After a stall, such as a blocked terminal, drop the missed frames instead of catching up
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)) {
+            next = now;
+        }
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    return NULL;
+}
+
+int s3m_ui_start(s3m_ui_t *ui) {
+    assert(ui);
+
+    pthread_mutex_init(&ui->lock, NULL);
+    ui->s3m = NULL;
+    ui->tag = 0;
+    atomic_init(&ui->stop, 0);
+
+    if (pthread_create(&ui->thread, NULL, ui_main, ui)) {
+        fprintf(stderr, "Warning: unable to start the display thread.\n");
+        pthread_mutex_destroy(&ui->lock);
+        return 1;
+    }
+
+    return 0;
+}
+
+void s3m_ui_set_module(s3m_ui_t *ui, s3m_t *s3m, uint8_t tag) {
+    // Once this returns, the display no longer touches the previous module
+    pthread_mutex_lock(&ui->lock);
+    ui->s3m = s3m;
+    ui->tag = tag;
+    pthread_mutex_unlock(&ui->lock);
+}
+
+void s3m_ui_stop(s3m_ui_t *ui) {
+    atomic_store(&ui->stop, 1);
+    pthread_join(ui->thread, NULL);
+
+    pthread_mutex_destroy(&ui->lock);
+}